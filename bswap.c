@@ -0,0 +1,170 @@
+// Byte order conversion
+
+#include <string.h>
+
+#include "type.h"
+#include "bswap.h"
+
+#if ( defined( __x86_64__ ) || defined( __i386__ ) ) && \
+    ( defined( __clang__ ) || __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) )
+#define BSWAP_X86 // kernels built for SSSE3 and AVX2, used if the cpu has them
+#include <immintrin.h>
+#elif defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#define BSWAP_NEON
+#include <arm_neon.h>
+#endif
+
+// reverse the bytes of single values of a size the kernels don't handle
+static void bswap_bytes( u8 *b, size_t size )
+{
+  size_t i;
+  for( i = 0; i < size / 2; i ++ )
+  {
+    u8 temp = b[ i ];
+    b[ i ] = b[ size - 1 - i ];
+    b[ size - 1 - i ] = temp;
+  }
+}
+
+// scalar conversion, for the tail a kernel leaves and for plain builds
+static void bswap_scalar( u8 *b, size_t count, size_t size )
+{
+  size_t i;
+
+  switch( size )
+  {
+    case 2:
+      for( i = 0; i < count; i ++ )
+      {
+        uint16_t x;
+        memcpy( &x, b + i * 2, 2 );
+        x = BSWAP16( x );
+        memcpy( b + i * 2, &x, 2 );
+      }
+      break;
+    case 4:
+      for( i = 0; i < count; i ++ )
+      {
+        uint32_t x;
+        memcpy( &x, b + i * 4, 4 );
+        x = BSWAP32( x );
+        memcpy( b + i * 4, &x, 4 );
+      }
+      break;
+    case 8:
+      for( i = 0; i < count; i ++ )
+      {
+        uint64_t x;
+        memcpy( &x, b + i * 8, 8 );
+        x = BSWAP64( x );
+        memcpy( b + i * 8, &x, 8 );
+      }
+      break;
+    default:
+      for( i = 0; i < count; i ++ )
+        bswap_bytes( b + i * size, size );
+  }
+}
+
+#ifdef BSWAP_X86
+// byte shuffles reversing 2, 4 and 8 byte values, the same for both 16 byte
+// lanes of an AVX2 register
+static const u8 bswap_shuffle[ 3 ][ 32 ] = {
+  { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+  { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+  { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 }
+};
+
+// the kernels convert whole registers and return the number of bytes done
+__attribute__(( target( "ssse3" ) ))
+static size_t bswap_ssse3( u8 *b, size_t len, const u8 *shuffle )
+{
+  __m128i mask = _mm_loadu_si128( ( const __m128i * )shuffle );
+  size_t i;
+
+  for( i = 0; i + 16 <= len; i += 16 )
+  {
+    __m128i v = _mm_loadu_si128( ( const __m128i * )( b + i ) );
+    _mm_storeu_si128( ( __m128i * )( b + i ), _mm_shuffle_epi8( v, mask ) );
+  }
+  return i;
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t bswap_avx2( u8 *b, size_t len, const u8 *shuffle )
+{
+  __m256i mask = _mm256_loadu_si256( ( const __m256i * )shuffle );
+  size_t i;
+
+  for( i = 0; i + 32 <= len; i += 32 )
+  {
+    __m256i v = _mm256_loadu_si256( ( const __m256i * )( b + i ) );
+    _mm256_storeu_si256( ( __m256i * )( b + i ), _mm256_shuffle_epi8( v, mask ) );
+  }
+  return i;
+}
+
+// best kernel the cpu supports: 0 none, 1 SSSE3, 2 AVX2, -1 not checked yet
+static int bswap_level = -1;
+
+static int bswap_detect( void )
+{
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "avx2" ) )
+    return 2;
+  if( __builtin_cpu_supports( "ssse3" ) )
+    return 1;
+  return 0;
+}
+
+static size_t bswap_vector( u8 *b, size_t len, size_t size )
+{
+  const u8 *shuffle = bswap_shuffle[ size == 2 ? 0 : size == 4 ? 1 : 2 ];
+  size_t done = 0;
+
+  if( bswap_level < 0 )
+    bswap_level = bswap_detect();
+  if( bswap_level >= 2 )
+    done = bswap_avx2( b, len, shuffle );
+  if( bswap_level >= 1 )
+    done += bswap_ssse3( b + done, len - done, shuffle );
+  return done;
+}
+#elif defined( BSWAP_NEON )
+static size_t bswap_vector( u8 *b, size_t len, size_t size )
+{
+  size_t i;
+
+  for( i = 0; i + 16 <= len; i += 16 )
+  {
+    uint8x16_t v = vld1q_u8( b + i );
+    switch( size )
+    {
+      case 2: v = vrev16q_u8( v ); break;
+      case 4: v = vrev32q_u8( v ); break;
+      default: v = vrev64q_u8( v ); break;
+    }
+    vst1q_u8( b + i, v );
+  }
+  return i;
+}
+#endif
+
+void bswap_block( void *block, size_t count, size_t size )
+{
+  u8 *b = ( u8 * )block;
+
+#if defined( BSWAP_X86 ) || defined( BSWAP_NEON )
+  if( size == 2 || size == 4 || size == 8 )
+  {
+    // registers hold whole values, so what is done ends on a value
+    size_t done = bswap_vector( b, count * size, size );
+    b += done;
+    count -= done / size;
+  }
+#endif
+  bswap_scalar( b, count, size );
+}
@@ -0,0 +1,26 @@
+// Byte order conversion
+//   single values are swapped with the compiler's byte swap builtins, blocks
+//   of values with SSSE3 / AVX2 byte shuffles (picked at run time) or NEON
+//   byte reversal, and a scalar loop for what is left.
+
+#ifndef __BSWAP_H__
+#define __BSWAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __GNUC__
+#define BSWAP16( x ) __builtin_bswap16( x )
+#define BSWAP32( x ) __builtin_bswap32( x )
+#define BSWAP64( x ) __builtin_bswap64( x )
+#else
+#define BSWAP16( x ) ( ( uint16_t )( ( uint16_t )( x ) << 8 | ( uint16_t )( x ) >> 8 ) )
+#define BSWAP32( x ) ( ( uint32_t )BSWAP16( ( uint16_t )( x ) ) << 16 | BSWAP16( ( uint16_t )( ( uint32_t )( x ) >> 16 ) ) )
+#define BSWAP64( x ) ( ( uint64_t )BSWAP32( ( uint32_t )( x ) ) << 32 | BSWAP32( ( uint32_t )( ( uint64_t )( x ) >> 32 ) ) )
+#endif
+
+// reverse the bytes of count values of the given size in place. sizes 2, 4
+// and 8 go through the vector kernels, others are reversed one by one.
+void bswap_block( void *block, size_t count, size_t size );
+
+#endif
@@ -56,7 +56,8 @@ enum
   RPC_CMD_CALL = 1,
   RPC_CMD_GET,
   RPC_CMD_CON,
-  RPC_CMD_NEWINDEX
+  RPC_CMD_NEWINDEX,
+  RPC_CMD_CALL_ID
 };
 
 // RPC Status Codes
@@ -67,7 +68,7 @@ enum
   RPC_DONE
 };
 
-enum { RPC_PROTOCOL_VERSION = 3 };
+enum { RPC_PROTOCOL_VERSION = 4 };
 
 // return a string representation of an error number 
 
@@ -89,6 +90,10 @@ static const char * errorString( int n )
 
 static int generic_catch_handler(lua_State *L, Handle *handle, struct exception e )
 {
+  // close before reporting, without an error handler deal_with_error doesn't
+  // return and a half written message would stay in the output buffer
+  if( e.type == fatal )
+    transport_close( &handle->tpt, L );
   deal_with_error( L, handle, errorString( e.errnum ) );
   switch( e.type )
   {
@@ -97,7 +102,6 @@ static int generic_catch_handler(lua_State *L, Handle *handle, struct exception
       return 1;
       break;
     case fatal:
-      transport_close( &handle->tpt );
       break;
     default: lua_assert( 0 );
   }
@@ -134,6 +138,7 @@ Handle *handle_create( lua_State *L )
   Handle *h = ( Handle * )lua_newuserdata( L, sizeof( Handle ) );
   luaL_getmetatable( L, "rpc.handle" );
   lua_setmetatable( L, -2 );
+  transport_init( &h->tpt );
   h->error_handler = LUA_NOREF;
   h->async = 0;
   h->read_reply_count = 0;
@@ -151,6 +156,8 @@ static Helper *helper_create( lua_State *L, Handle *handle, const char *funcname
   h->handle = handle;
   h->parent = NULL;
   h->nparents = 0;
+  h->path_id = 0;
+  h->path_session = 0;
   strncpy( h->funcname, funcname, NUM_FUNCNAME_CHARS );
   return h;
 }
@@ -218,7 +225,7 @@ void helper_remote_index( Helper *helper )
     for( i = helper->nparents - 1 ; i > 0 ; i -- )
     {
       hstack[ i - 1 ] = hstack[ i ]->parent;
-      len += strlen( hstack[ i ]->funcname ) + 1;
+      len += strlen( hstack[ i - 1 ]->funcname ) + 1;
     }
 	
 	  transport_write_u32( tpt, len );
@@ -236,6 +243,66 @@ void helper_remote_index( Helper *helper )
   transport_write_string( tpt, helper->funcname, strlen( helper->funcname ) );
 }
 
+// push the dotted path of a helper as a string
+static void helper_push_path( lua_State *L, Helper *helper )
+{
+  luaL_Buffer b;
+  Helper **hstack;
+  int i;
+
+  if( helper->nparents == 0 )
+  {
+    lua_pushstring( L, helper->funcname );
+    return;
+  }
+
+  hstack = ( Helper ** )alloca( sizeof( Helper * ) * helper->nparents );
+  hstack[ helper->nparents - 1 ] = helper->parent;
+  for( i = helper->nparents - 1 ; i > 0 ; i -- )
+    hstack[ i - 1 ] = hstack[ i ]->parent;
+
+  luaL_buffinit( L, &b );
+  for( i = 0 ; i < helper->nparents ; i ++ )
+  {
+    luaL_addstring( &b, hstack[ i ]->funcname );
+    luaL_addchar( &b, '.' );
+  }
+  luaL_addstring( &b, helper->funcname );
+  luaL_pushresult( &b );
+}
+
+// look up the number the server gave to the path at the top of the stack,
+// 0 if it has none yet
+static u32 helper_path_id( lua_State *L, Transport *tpt )
+{
+  u32 id = 0;
+
+  if( tpt->paths_ref == LUA_NOREF )
+    return 0;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->paths_ref );
+  lua_pushvalue( L, -2 );
+  lua_rawget( L, -2 );
+  if( lua_type( L, -1 ) == LUA_TNUMBER )
+    id = ( u32 )lua_tonumber( L, -1 );
+  lua_pop( L, 2 );
+  return id;
+}
+
+// remember the number the server gave to the path at the given index
+static void helper_path_learn( lua_State *L, Transport *tpt, int path_index, u32 id )
+{
+  if( tpt->paths_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    tpt->paths_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->paths_ref );
+  lua_pushvalue( L, path_index );
+  lua_pushnumber( L, id );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+}
+
 #ifdef HELPER_WAIT
 static void helper_wait_ready( Transport *tpt, u8 cmd )
 {
@@ -302,9 +369,7 @@ static int helper_get( lua_State *L, Helper *helper )
 //         /* read error and handle it */
 //         u32 code = transport_read_u32( tpt );
 //         u32 len = transport_read_u32( tpt );
-//         char *err_string = ( char * )alloca( len + 1 );
-//         transport_read_string( tpt, err_string, len );
-//         err_string[ len ] = 0;
+//         char *err_string = transport_read_scratch( tpt, len );
 // 
 //         deal_with_error( L, h->handle, err_string );
 //         freturn = 0;
@@ -338,16 +403,41 @@ static int helper_call (lua_State *L)
     Try
     {
       int i,n;
-      u32 nret,ret_code;
+      u32 nret,ret_code,id = 0;
 
-     TRANSPORT_START_WRITING(tpt);
-      // write function name
-      helper_wait_ready( tpt, RPC_CMD_CALL );
-      helper_remote_index( h );
+      n = lua_gettop( L );
 
+     TRANSPORT_START_WRITING(tpt);
+      // write function name, or its number if the server gave it one. the
+      // helper keeps the number, otherwise the path is looked up and kept
+      // above the arguments to learn the number from the reply
+      if( tpt->options & RPC_OPT_PATHID )
+      {
+        if( h->path_session == tpt->session )
+          id = h->path_id;
+        else
+        {
+          helper_push_path( L, h );
+          id = helper_path_id( L, tpt );
+          if( id != 0 )
+          {
+            h->path_id = id;
+            h->path_session = tpt->session;
+          }
+        }
+      }
+      if( id != 0 )
+      {
+        helper_wait_ready( tpt, RPC_CMD_CALL_ID );
+        transport_write_uvarint( tpt, id );
+      }
+      else
+      {
+        helper_wait_ready( tpt, RPC_CMD_CALL );
+        helper_remote_index( h );
+      }
 
       // write number of arguments
-      n = lua_gettop( L );
       transport_write_u32( tpt, n - 1 );
     
       // write each argument
@@ -362,6 +452,18 @@ static int helper_call (lua_State *L)
       }*/
 
       TRANSPORT_START_READING(tpt);
+      // a call by name is answered with the number of the path first
+      if( id == 0 && ( tpt->options & RPC_OPT_PATHID ) )
+      {
+        id = ( u32 )transport_read_uvarint( tpt );
+        if( id != 0 )
+        {
+          helper_path_learn( L, tpt, n + 1, id );
+          h->path_id = id;
+          h->path_session = tpt->session;
+        }
+      }
+
       // read return code
       ret_code = transport_read_u8( tpt );
 
@@ -380,9 +482,7 @@ static int helper_call (lua_State *L)
         // read error and handle it
         transport_read_u32( tpt ); // read code (not being used here)
         u32 len = transport_read_u32( tpt );
-        char *err_string = ( char * )alloca( len + 1 );
-        transport_read_string( tpt, err_string, len );
-        err_string[ len ] = 0;
+        char *err_string = transport_read_scratch( tpt, len );
 
         deal_with_error( L, h->handle, err_string );
         freturn = 0;
@@ -432,9 +532,7 @@ static int helper_newindex( lua_State *L )
       // read error and handle it
       transport_read_u32( tpt ); // Read code (not using here)
       u32 len = transport_read_u32( tpt );
-      char *err_string = ( char * )alloca( len + 1 );
-      transport_read_string( tpt, err_string, len );
-      err_string[ len ] = 0;
+      char *err_string = transport_read_scratch( tpt, len );
 
       deal_with_error( L, h->handle, err_string );
     }
@@ -462,6 +560,8 @@ static Helper *helper_append( lua_State *L, Helper *helper, const char *funcname
   h->handle = helper->handle;
   h->parent = helper;
   h->nparents = helper->nparents + 1;
+  h->path_id = 0;
+  h->path_session = 0;
   strncpy ( h->funcname, funcname, NUM_FUNCNAME_CHARS );
   return h;
 }
@@ -485,6 +585,14 @@ static int helper_index( lua_State *L )
   return 1;
 }
 
+// collecting a handle closes its transport and frees its buffers
+static int handle_gc( lua_State *L )
+{
+  Handle *h = ( Handle * )luaL_checkudata( L, 1, "rpc.handle" );
+  transport_close( &h->tpt, L );
+  return 0;
+}
+
 static int helper_close (lua_State *L)
 {
   Helper *h = ( Helper * )luaL_checkudata(L, 1, "rpc.helper");
@@ -505,6 +613,7 @@ const LUA_REG_TYPE rpc_handle[] =
 {
   { LSTRKEY( "__index" ), LFUNCVAL( handle_index ) },
   { LSTRKEY( "__newindex"), LFUNCVAL( handle_newindex )},
+  { LSTRKEY( "__gc" ), LFUNCVAL( handle_gc ) },
   { LNILKEY, LNILVAL }
 };
 
@@ -537,6 +646,7 @@ static const luaL_reg rpc_handle[] =
 {
   { "__index", handle_index },
   { "__newindex", handle_newindex },
+  { "__gc", handle_gc },
   { NULL, NULL }
 };
 
@@ -108,7 +108,8 @@ enum
   RPC_CMD_CALL = 1,
   RPC_CMD_GET,
   RPC_CMD_CON,
-  RPC_CMD_NEWINDEX
+  RPC_CMD_NEWINDEX,
+  RPC_CMD_CALL_ID
 };
 
 // RPC Status Codes
@@ -119,7 +120,7 @@ enum
   RPC_DONE
 };
 
-enum { RPC_PROTOCOL_VERSION = 3 };
+enum { RPC_PROTOCOL_VERSION = 4 };
 
 
 // return a string representation of an error number 
@@ -169,6 +170,7 @@ int ismetatable_type( lua_State *L, int ud, const char *tname )
       lua_pop( L, 2 );  // remove both metatables
       return 1;
     }
+    lua_pop( L, 2 );
   }
   return 0;
 }
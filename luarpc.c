@@ -39,6 +39,14 @@ void *alloca(size_t);
 
 #include "luarpc_rpc.h"
 
+#ifdef LUARPC_ENABLE_PREFORK
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
 
 #ifdef BUILD_RPC
 
@@ -62,7 +70,8 @@ enum
   RPC_CMD_CALL = 1,
   RPC_CMD_GET,
   RPC_CMD_CON,
-  RPC_CMD_NEWINDEX
+  RPC_CMD_NEWINDEX,
+  RPC_CMD_CALL_ID
 };
 
 // RPC Status Codes
@@ -73,7 +82,7 @@ enum
   RPC_DONE
 };
 
-enum { RPC_PROTOCOL_VERSION = 3 };
+enum { RPC_PROTOCOL_VERSION = 4 };
 
 // return a string representation of an error number 
 
@@ -96,13 +105,54 @@ static const char * errorString( int n )
 // rpc utilities
 
 // functions for sending and receving headers 
-static void client_negotiate( Transport *tpt )
+//   a header is "LRPC", the protocol version, the little endian flag, the
+//   size of a number, the integer number flag and from version 4 on 4 bytes
+//   of protocol options (RPC_OPT_*, lowest byte first). version 3 peers have
+//   no options.
+
+static void header_put_options( char *header, u32 options )
+{
+  int i;
+  for( i = 0; i < 4; i ++ )
+    header[ 8 + i ] = ( char )( options >> ( 8 * i ) );
+}
+
+static u32 header_get_options( const char *header )
+{
+  u32 options = 0;
+  int i;
+  for( i = 0; i < 4; i ++ )
+    options |= ( u32 )( u8 )header[ 8 + i ] << ( 8 * i );
+  return options;
+}
+
+// check the part of a header all versions have, the version must be one
+// spoken here and no newer than max
+static void header_check( const char *header, char max )
 {
   struct exception e;
-  char header[ 8 ];
+
+  if( header[0] != 'L' ||
+      header[1] != 'R' ||
+      header[2] != 'P' ||
+      header[3] != 'C' ||
+      header[4] < RPC_PROTOCOL_VERSION_MIN ||
+      header[4] > max )
+  {
+    e.errnum = ERR_HEADER;
+    e.type = nonfatal;
+    Throw( e );
+  }
+}
+
+static void client_negotiate( Transport *tpt, lua_State *L, char version )
+{
+  char header[ RPC_HEADER_SIZE ];
   int x = 1;
 
   TRANSPORT_START_WRITING(tpt);
+  transport_write_u8( tpt, RPC_CMD_CON );
+
   // default client configuration
   tpt->loc_little = ( char )*( char * )&x;
   tpt->lnum_bytes = ( char )sizeof( lua_Number );
@@ -113,63 +163,94 @@ static void client_negotiate( Transport *tpt )
   header[1] = 'R';
   header[2] = 'P';
   header[3] = 'C';
-  header[4] = RPC_PROTOCOL_VERSION;
+  header[4] = version;
   header[5] = tpt->loc_little;
   header[6] = tpt->lnum_bytes;
   header[7] = tpt->loc_intnum;
-  transport_write_string( tpt, header, sizeof( header ) );
+  header_put_options( header, LUARPC_OPTIONS );
+  transport_write_string( tpt, header, version >= RPC_PROTOCOL_VERSION_OPTIONS ?
+                          RPC_HEADER_SIZE : RPC_HEADER_BASE_SIZE );
   
   
   TRANSPORT_START_READING(tpt);
-  // read server's response
-  transport_read_string( tpt, header, sizeof( header ) );
-  if( header[0] != 'L' ||
-      header[1] != 'R' ||
-      header[2] != 'P' ||
-      header[3] != 'C' ||
-      header[4] != RPC_PROTOCOL_VERSION )
+  // read server's response, which may be for an older version
+  transport_read_string( tpt, header, RPC_HEADER_BASE_SIZE );
+  header_check( header, version );
+  tpt->options = 0;
+  if( header[4] >= RPC_PROTOCOL_VERSION_OPTIONS )
   {
-    e.errnum = ERR_HEADER;
-    e.type = nonfatal;
-    Throw( e );
+    transport_read_string( tpt, header + RPC_HEADER_BASE_SIZE,
+                           RPC_HEADER_SIZE - RPC_HEADER_BASE_SIZE );
+    tpt->options = header_get_options( header ) & LUARPC_OPTIONS;
   }
   
   TRANSPORT_STOP(tpt);
 
-  // write configuration from response
-  tpt->net_little = header[5];
+  // write configuration from response, with the native byte order option
+  // the server tells its own order, which only replies come in
+  tpt->rd_little = header[5];
+  tpt->net_little = ( tpt->options & RPC_OPT_NATIVE ) ? tpt->loc_little : header[5];
   tpt->lnum_bytes = header[6];
   tpt->net_intnum = header[7];
+  transport_session_reset( tpt, L );
 }
 
-void server_negotiate( Transport *tpt )
+// start the session of a new connection. servers older than the options in
+// the header close the link on seeing one, the connection is then made again
+// with the header they know.
+static void client_start( lua_State *L, Handle *handle )
 {
   struct exception e;
-  char header[ 8 ];
-  int x = 1;
+
+  Try
+  {
+    client_negotiate( &handle->tpt, L, RPC_PROTOCOL_VERSION );
+  }
+  Catch( e )
+  {
+    if( e.errnum == ERR_HEADER )
+      Throw( e );
+    transport_close( &handle->tpt, L );
+    transport_open_connection( L, handle );
+    client_negotiate( &handle->tpt, L, RPC_PROTOCOL_VERSION_MIN );
+  }
+}
+
+void server_negotiate( Transport *tpt, lua_State *L )
+{
+  char header[ RPC_HEADER_SIZE ];
+  int x = 1, size = RPC_HEADER_BASE_SIZE;
   
   TRANSPORT_START_READING(tpt);
  // default sever configuration
-  tpt->net_little = tpt->loc_little = ( char )*( char * )&x;
+  tpt->rd_little = tpt->net_little = tpt->loc_little = ( char )*( char * )&x;
   tpt->lnum_bytes = ( char )sizeof( lua_Number );
   tpt->net_intnum = tpt->loc_intnum = ( char )( ( ( lua_Number )0.5 ) == 0 );
   
-  // read and check header from client
-  transport_read_string( tpt, header, sizeof( header ) );
-  if( header[0] != 'L' ||
-      header[1] != 'R' ||
-      header[2] != 'P' ||
-      header[3] != 'C' ||
-      header[4] != RPC_PROTOCOL_VERSION )
+  // read and check header from client, the answer is for its version
+  transport_read_string( tpt, header, RPC_HEADER_BASE_SIZE );
+  header_check( header, RPC_PROTOCOL_VERSION );
+  
+  // use the options both ends know, older clients have none
+  tpt->options = 0;
+  if( header[ 4 ] >= RPC_PROTOCOL_VERSION_OPTIONS )
   {
-    e.errnum = ERR_HEADER;
-    e.type = nonfatal;
-    Throw( e );
+    transport_read_string( tpt, header + RPC_HEADER_BASE_SIZE,
+                           RPC_HEADER_SIZE - RPC_HEADER_BASE_SIZE );
+    tpt->options = header_get_options( header ) & LUARPC_OPTIONS;
+    size = RPC_HEADER_SIZE;
   }
-  
-  // check if endianness differs, if so use big endian order  
-  if( header[ 5 ] != tpt->loc_little )
-    header[ 5 ] = tpt->net_little = 0;
+
+  // with the native byte order option each end sends in its own order and
+  // converts what it reads: the client's order is kept for reading and the
+  // reply tells ours. otherwise if endianness differs, use big endian order
+  if( tpt->options & RPC_OPT_NATIVE )
+  {
+    tpt->rd_little = header[ 5 ];
+    header[ 5 ] = tpt->loc_little;
+  }
+  else if( header[ 5 ] != tpt->loc_little )
+    header[ 5 ] = tpt->rd_little = tpt->net_little = 0;
     
   // set number precision to lowest common denominator 
   if( header[ 6 ] > tpt->lnum_bytes )
@@ -180,10 +261,13 @@ void server_negotiate( Transport *tpt )
   // if lua_Number is integer on either side, use integer 
   if( header[ 7 ] != tpt->loc_intnum )
     header[ 7 ] = tpt->net_intnum = 1;
+
+  header_put_options( header, tpt->options );
+  transport_session_reset( tpt, L );
   
   // send reconciled configuration to client
   TRANSPORT_START_WRITING(tpt);
-  transport_write_string( tpt, header, sizeof( header ) );
+  transport_write_string( tpt, header, size );
   TRANSPORT_STOP(tpt);
 }
 
@@ -193,7 +277,8 @@ int global_error_handler = LUA_NOREF;
 // **************************************************************************
 // remote function calling (client side)
 
-// rpc_connect (ip_address, port)
+// rpc_connect (ip_address, port [, options]) or rpc_connect ("unix:/path")
+//      options is a table of transport settings (tcpip: timeout in seconds)
 //      returns a handle to the new connection, or nil if there was an error.
 //      if there is an RPC error function defined, it will be called on error.
 
@@ -207,9 +292,7 @@ static int rpc_connect( lua_State *L )
     handle = handle_create ( L );
     transport_open_connection( L, handle );
 
-    TRANSPORT_START_WRITING(&handle->tpt);
-    transport_write_u8( &handle->tpt, RPC_CMD_CON );
-    client_negotiate( &handle->tpt );
+    client_start( L, handle );
   }
   Catch( e )
   {     
@@ -220,6 +303,233 @@ static int rpc_connect( lua_State *L )
 }
 
 
+// **************************************************************************
+// client connection pool
+//   a pool keeps up to size connected and negotiated handles ready. a handle
+//   taken with get() is the caller's until it is given back with put().
+//   idle handles that were closed or show incoming data (the server went away)
+//   are dropped, maintain() replaces them.
+
+// push rpc_connect and the saved arguments, returns the number of arguments
+static int pool_push_connect( lua_State *L, Pool *p )
+{
+  int i, n;
+
+  lua_pushcfunction( L, rpc_connect );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->args_ref );
+  lua_getfield( L, -1, "n" );
+  n = ( int )lua_tonumber( L, -1 );
+  lua_pop( L, 1 );
+  for( i = 1; i <= n; i ++ )
+    lua_rawgeti( L, -i, i );
+  lua_remove( L, -n - 1 );
+  return n;
+}
+
+// open a pool connection. on success the handle is left on the stack and 1 is
+// returned, failures return 0 and leave nothing.
+static int pool_connect( lua_State *L, Pool *p )
+{
+  int n = pool_push_connect( L, p );
+
+  if( lua_pcall( L, n, 1, 0 ) != 0 || !lua_isuserdata( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    return 0;
+  }
+  return 1;
+}
+
+// an idle handle is usable if it is open and the server hasn't sent anything
+static int pool_handle_ok( lua_State *L, Handle *h )
+{
+  struct exception e;
+  int ok = 0;
+
+  Try
+  {
+    ok = transport_is_open( &h->tpt ) && !transport_readable( &h->tpt );
+  }
+  Catch( e )
+  {
+    if( e.type == fatal )
+      transport_close( &h->tpt, L );
+    ok = 0;
+  }
+  return ok;
+}
+
+// move the healthy idle handles to the bottom of the stack, close the others
+static void pool_check( lua_State *L, Pool *p )
+{
+  int i, n = 0;
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->idle_ref );
+  for( i = 1; i <= p->nidle; i ++ )
+  {
+    Handle *h;
+
+    lua_rawgeti( L, -1, i );
+    h = ( Handle * )lua_touserdata( L, -1 );
+    if( pool_handle_ok( L, h ) )
+      lua_rawseti( L, -2, ++ n );
+    else
+    {
+      transport_close( &h->tpt, L );
+      lua_pop( L, 1 );
+    }
+  }
+  for( i = n + 1; i <= p->nidle; i ++ )
+  {
+    lua_pushnil( L );
+    lua_rawseti( L, -2, i );
+  }
+  p->nidle = n;
+  lua_pop( L, 1 );
+}
+
+static Pool *check_pool( lua_State *L )
+{
+  return ( Pool * )luaL_checkudata( L, 1, "rpc.pool" );
+}
+
+// pool:get() --> handle
+//    lends an idle handle, a new connection is made if none is left
+static int pool_get( lua_State *L )
+{
+  Pool *p = check_pool( L );
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->idle_ref );
+  while( p->nidle > 0 )
+  {
+    Handle *h;
+
+    lua_rawgeti( L, -1, p->nidle );
+    lua_pushnil( L );
+    lua_rawseti( L, -3, p->nidle -- );
+    h = ( Handle * )lua_touserdata( L, -1 );
+    if( pool_handle_ok( L, h ) )
+      return 1;
+    transport_close( &h->tpt, L );
+    lua_pop( L, 1 );
+  }
+  lua_pop( L, 1 );
+
+  // nothing ready, connect now like rpc.connect would
+  lua_call( L, pool_push_connect( L, p ), 1 );
+  return 1;
+}
+
+// pool:put( handle )
+//    gives a handle back, it is closed if broken or if the pool is full
+static int pool_put( lua_State *L )
+{
+  Pool *p = check_pool( L );
+  Handle *h;
+
+  if( !( lua_isuserdata( L, 2 ) && ismetatable_type( L, 2, "rpc.handle" ) ) )
+    return luaL_error( L, "arg must be handle" );
+  h = ( Handle * )lua_touserdata( L, 2 );
+
+  if( p->nidle < p->size && pool_handle_ok( L, h ) )
+  {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, p->idle_ref );
+    lua_pushvalue( L, 2 );
+    lua_rawseti( L, -2, ++ p->nidle );
+  }
+  else
+    transport_close( &h->tpt, L );
+  return 0;
+}
+
+// pool:maintain() --> number of idle handles
+//    drops broken handles and reconnects until size handles are ready. meant
+//    to be called between requests, e.g. from the loop around rpc.peek.
+static int pool_maintain( lua_State *L )
+{
+  Pool *p = check_pool( L );
+
+  pool_check( L, p );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->idle_ref );
+  while( p->nidle < p->size && pool_connect( L, p ) )
+    lua_rawseti( L, -2, ++ p->nidle );
+  lua_pushnumber( L, p->nidle );
+  return 1;
+}
+
+static void pool_close( lua_State *L, Pool *p )
+{
+  int i;
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->idle_ref );
+  for( i = 1; i <= p->nidle; i ++ )
+  {
+    lua_rawgeti( L, -1, i );
+    transport_close( &( ( Handle * )lua_touserdata( L, -1 ) )->tpt, L );
+    lua_pop( L, 1 );
+    lua_pushnil( L );
+    lua_rawseti( L, -2, i );
+  }
+  lua_pop( L, 1 );
+  p->nidle = 0;
+  p->size = 0;
+}
+
+// pool:close()
+//    closes the idle handles, handles that are lent out are not affected
+static int pool_close_method( lua_State *L )
+{
+  pool_close( L, check_pool( L ) );
+  return 0;
+}
+
+static int pool_gc( lua_State *L )
+{
+  Pool *p = check_pool( L );
+  luaL_unref( L, LUA_REGISTRYINDEX, p->args_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, p->idle_ref );
+  return 0;
+}
+
+// rpc_pool( transport_identifier..., size ) --> pool
+//    takes the arguments of rpc_connect followed by the number of handles to
+//    keep ready. the handles are connected right away, failures are retried
+//    by maintain().
+static int rpc_pool( lua_State *L )
+{
+  Pool *p;
+  int i, n = lua_gettop( L ) - 1;
+  int size = luaL_checkint( L, n + 1 );
+
+  if( n < 1 || size < 1 )
+    return luaL_error( L, "usage: rpc.pool( connect arguments..., size )" );
+
+  p = ( Pool * )lua_newuserdata( L, sizeof( Pool ) );
+  luaL_getmetatable( L, "rpc.pool" );
+  lua_setmetatable( L, -2 );
+  p->size = size;
+  p->nidle = 0;
+
+  lua_createtable( L, n, 1 );
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_pushvalue( L, i );
+    lua_rawseti( L, -2, i );
+  }
+  lua_pushnumber( L, n );
+  lua_setfield( L, -2, "n" );
+  p->args_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+  lua_createtable( L, size, 0 );
+  p->idle_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+  lua_pushcfunction( L, pool_maintain );
+  lua_pushvalue( L, -2 );
+  lua_call( L, 1, 0 );
+  return 1;
+}
+
+
 // rpc_close( handle )
 //     this closes the transport, but does not free the handle object. that's
 //     because the handle will still be in the user's name space and might be
@@ -236,13 +546,18 @@ static int rpc_close( lua_State *L )
     if( ismetatable_type( L, 1, "rpc.handle" ) )
     {
       Handle *handle = ( Handle * )lua_touserdata( L, 1 );
-      transport_close( &handle->tpt );
+      transport_close( &handle->tpt, L );
       return 0;
     }
     if( ismetatable_type( L, 1, "rpc.server_handle" ) )
     {
       ServerHandle *handle = ( ServerHandle * )lua_touserdata( L, 1 );
-      server_handle_shutdown( handle );
+      server_handle_shutdown( L, handle );
+      return 0;
+    }
+    if( ismetatable_type( L, 1, "rpc.pool" ) )
+    {
+      pool_close( L, ( Pool * )lua_touserdata( L, 1 ) );
       return 0;
     }
   }
@@ -267,7 +582,7 @@ static ServerHandle *rpc_listen_helper( lua_State *L )
   Catch( e )
   {
     if( handle )
-      server_handle_destroy( handle );
+      server_handle_destroy( L, handle );
     
     deal_with_error( L, 0, errorString( e.errnum ) );
     return 0;
@@ -275,8 +590,10 @@ static ServerHandle *rpc_listen_helper( lua_State *L )
   return handle;
 }
 
-// rpc_listen( transport_indentifier ) --> server_handle
+// rpc_listen( transport_indentifier [, options] ) --> server_handle
 //    transport_identifier defines where to listen, identifier type is subject to transport implementation
+//    (tcpip: port number or "unix:/path" for a unix domain socket)
+//    options is a table of transport settings (tcpip: backlog, reuseport)
 static int rpc_listen( lua_State *L )
 {
   ServerHandle *handle;
@@ -300,6 +617,32 @@ static int rpc_peek( lua_State *L )
 
   handle = ( ServerHandle * )lua_touserdata( L, 1 );
 
+#ifdef LUARPC_ENABLE_EPOLL
+  // event driven server, see if any connection has data to read
+  if ( handle->epfd >= 0 )
+  {
+    struct exception e;
+    ServerConn *ready[ MAX_EVENTS ];
+    int n = 0;
+
+    Try
+    {
+      n = transport_wait_events( handle, ready, MAX_EVENTS, 0 );
+    }
+    Catch( e )
+    {
+      deal_with_error( L, 0, errorString( e.errnum ) );
+    }
+
+    if ( n > 0 )
+      lua_pushnumber( L, 1 );
+    else
+      lua_pushnil( L );
+
+    return 1;
+  }
+#endif
+
   // if accepting transport is open, see if there is any data to read
   if ( transport_is_open( &handle->atpt ) )
   {
@@ -327,7 +670,75 @@ static int rpc_peek( lua_State *L )
 }
 
 
-// rpc_server( transport_identifier )
+// rpc_wait( handles [, timeout] ) --> table of ready handles
+//    sleeps until any of the server and client handles in the handles array
+//    has something to do: a call to dispatch, a connection to accept or a
+//    reply to read. timeout is in seconds, nil waits forever. the ready
+//    handles are returned in an array, which is empty on timeout.
+static int rpc_wait( lua_State *L )
+{
+  struct exception e;
+  TransportPoll *p;
+  int i, n = 0, count, timeout = -1;
+
+  luaL_checktype( L, 1, LUA_TTABLE );
+  if( !lua_isnoneornil( L, 2 ) )
+  {
+    lua_Number t = luaL_checknumber( L, 2 );
+    timeout = t > 0 ? ( int )( t * 1000 ) : 0;
+  }
+
+  count = lua_objlen( L, 1 );
+  p = ( TransportPoll * )lua_newuserdata( L, count * sizeof( TransportPoll ) + 1 );
+  for( i = 0; i < count; i ++ )
+  {
+    memset( &p[ i ], 0, sizeof( TransportPoll ) );
+    lua_rawgeti( L, 1, i + 1 );
+    if( lua_isuserdata( L, -1 ) && ismetatable_type( L, -1, "rpc.handle" ) )
+      p[ i ].tpt = &( ( Handle * )lua_touserdata( L, -1 ) )->tpt;
+    else if( lua_isuserdata( L, -1 ) && ismetatable_type( L, -1, "rpc.server_handle" ) )
+    {
+      ServerHandle *handle = ( ServerHandle * )lua_touserdata( L, -1 );
+
+#ifdef LUARPC_ENABLE_EPOLL
+      if( handle->epfd >= 0 )
+        p[ i ].server = handle;
+      else
+#endif
+      // like rpc_peek, a connected server waits for its client
+      if( transport_is_open( &handle->atpt ) )
+        p[ i ].tpt = &handle->atpt;
+      else
+        p[ i ].tpt = &handle->ltpt;
+    }
+    else
+      return luaL_error( L, "handles must be client or server handles" );
+    lua_pop( L, 1 );
+  }
+
+  Try
+  {
+    n = transport_poll( p, count, timeout );
+  }
+  Catch( e )
+  {
+    deal_with_error( L, 0, errorString( e.errnum ) );
+  }
+
+  lua_createtable( L, n, 0 );
+  for( i = 0, n = 0; i < count; i ++ )
+    if( p[ i ].ready )
+    {
+      lua_rawgeti( L, 1, i + 1 );
+      lua_rawseti( L, -2, ++n );
+    }
+  return 1;
+}
+
+
+// rpc_server( transport_identifier [, options] )
+//    serves clients until the server is closed. on linux tcpip servers accept
+//    any number of connections and serve them from one event loop.
 static int rpc_server( lua_State *L )
 {
   int shref;
@@ -336,10 +747,6 @@ static int rpc_server( lua_State *L )
   // Anchor handle in the registry
   //   This is needed because garbage collection can steal our handle, 
   //   which isn't otherwise referenced
-  //
-  //   @@@ this should be replaced when we create a system for multiple 
-  //   @@@ connections. such a mechanism would likely likely create a
-  //   @@@ table for multiple connections that we could service in an event loop 
   
   shref = luaL_ref( L, LUA_REGISTRYINDEX );
   lua_rawgeti(L, LUA_REGISTRYINDEX, shref );
@@ -348,7 +755,7 @@ static int rpc_server( lua_State *L )
     rpc_dispatch_helper( L, handle );
     
   luaL_unref( L, LUA_REGISTRYINDEX, shref );
-  server_handle_destroy( handle );
+  server_handle_destroy( L, handle );
   return 0;
 }
 
@@ -379,6 +786,57 @@ static int rpc_on_error( lua_State *L )
   return 0;
 }
 
+#ifdef LUARPC_ENABLE_PREFORK
+// rpc_prefork( n ) --> worker index in children, nil in parent
+//    forks n worker processes. each worker gets its index (1..n) and should
+//    open its own server with { reuseport = true }, the kernel then balances
+//    connections between them. the parent waits until all workers exit.
+static int rpc_prefork( lua_State *L )
+{
+  int n = luaL_checkint( L, 1 );
+  pid_t *pids;
+  int i, err;
+
+  if ( n < 1 )
+    return luaL_error( L, "worker count must be positive" );
+
+  pids = ( pid_t * )lua_newuserdata( L, n * sizeof( pid_t ) );
+  for ( i = 0; i < n; i++ )
+  {
+    pids[ i ] = fork();
+    if ( pids[ i ] == 0 )
+    {
+      lua_pushnumber( L, i + 1 );
+      return 1;
+    }
+    if ( pids[ i ] < 0 )
+    {
+      err = errno;
+      while ( i-- > 0 )
+      {
+        kill( pids[ i ], SIGTERM );
+        waitpid( pids[ i ], NULL, 0 );
+      }
+      return luaL_error( L, "fork failed: %s", strerror( err ) );
+    }
+  }
+
+  for ( i = 0; i < n; i++ )
+    while ( waitpid( pids[ i ], NULL, 0 ) < 0 && errno == EINTR );
+
+  lua_pushnil( L );
+  return 1;
+}
+#endif
+
+// collecting a server handle closes its transports and frees their buffers
+static int server_handle_gc( lua_State *L )
+{
+  ServerHandle *handle = ( ServerHandle * )luaL_checkudata( L, 1, "rpc.server_handle" );
+  server_handle_destroy( L, handle );
+  return 0;
+}
+
 // **************************************************************************
 // register RPC functions 
 
@@ -389,6 +847,18 @@ static int rpc_on_error( lua_State *L )
 
 const LUA_REG_TYPE rpc_server_handle[] =
 {
+  { LSTRKEY( "__gc" ), LFUNCVAL( server_handle_gc ) },
+  { LNILKEY, LNILVAL }
+};
+
+const LUA_REG_TYPE rpc_pool_map[] =
+{
+  { LSTRKEY( "get" ), LFUNCVAL( pool_get ) },
+  { LSTRKEY( "put" ), LFUNCVAL( pool_put ) },
+  { LSTRKEY( "maintain" ), LFUNCVAL( pool_maintain ) },
+  { LSTRKEY( "close" ), LFUNCVAL( pool_close_method ) },
+  { LSTRKEY( "__gc" ), LFUNCVAL( pool_gc ) },
+  { LSTRKEY( "__index" ), LROVAL( rpc_pool_map ) },
   { LNILKEY, LNILVAL }
 };
 
@@ -400,7 +870,17 @@ const LUA_REG_TYPE rpc_map[] =
   {  LSTRKEY( "on_error" ), LFUNCVAL( rpc_on_error ) },
   {  LSTRKEY( "listen" ), LFUNCVAL( rpc_listen ) },
   {  LSTRKEY( "peek" ), LFUNCVAL( rpc_peek ) },
+  {  LSTRKEY( "wait" ), LFUNCVAL( rpc_wait ) },
   {  LSTRKEY( "dispatch" ), LFUNCVAL( rpc_dispatch ) },
+  {  LSTRKEY( "pool" ), LFUNCVAL( rpc_pool ) },
+  {  LSTRKEY( "encode" ), LFUNCVAL( rpc_encode ) },
+  {  LSTRKEY( "decode" ), LFUNCVAL( rpc_decode ) },
+#ifdef LUARPC_ENABLE_FILE
+  {  LSTRKEY( "file" ), LFUNCVAL( rpc_file ) },
+#endif
+#ifdef LUARPC_ENABLE_PREFORK
+  {  LSTRKEY( "prefork" ), LFUNCVAL( rpc_prefork ) },
+#endif
 //  {  LSTRKEY( "rpc_async" ), LFUNCVAL( rpc_async ) },
 #if LUA_OPTIMIZE_MEMORY > 0
 // {  LSTRKEY("mode"), LSTRVAL( LUARPC_MODE ) }, 
@@ -415,6 +895,11 @@ LUALIB_API int luaopen_rpc(lua_State *L)
   register_client(L);
 
   luaL_rometatable(L, "rpc.server_handle", (void*)rpc_server_handle);
+  luaL_rometatable(L, "rpc.pool", (void*)rpc_pool_map);
+  register_codec(L);
+#ifdef LUARPC_ENABLE_FILE
+  register_file(L);
+#endif
 #else
   luaL_register( L, "rpc", rpc_map );
   lua_pushstring( L, LUARPC_MODE );
@@ -423,6 +908,18 @@ LUALIB_API int luaopen_rpc(lua_State *L)
   register_client(L);
 
   luaL_newmetatable( L, "rpc.server_handle" );
+  luaL_register( L, NULL, rpc_server_handle );
+  lua_pop( L, 1 );
+
+  luaL_newmetatable( L, "rpc.pool" );
+  luaL_register( L, NULL, rpc_pool_map );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  lua_pop( L, 1 );
+  register_codec(L);
+#ifdef LUARPC_ENABLE_FILE
+  register_file(L);
+#endif
 #endif
   return 1;
 }
@@ -431,6 +928,17 @@ LUALIB_API int luaopen_rpc(lua_State *L)
 
 static const luaL_reg rpc_server_handle[] =
 {
+  { "__gc", server_handle_gc },
+  { NULL, NULL }
+};
+
+static const luaL_reg rpc_pool_map[] =
+{
+  { "get", pool_get },
+  { "put", pool_put },
+  { "maintain", pool_maintain },
+  { "close", pool_close_method },
+  { "__gc", pool_gc },
   { NULL, NULL }
 };
 
@@ -442,7 +950,17 @@ static const luaL_reg rpc_map[] =
   { "on_error", rpc_on_error },
   { "listen", rpc_listen },
   { "peek", rpc_peek },
+  { "wait", rpc_wait },
   { "dispatch", rpc_dispatch },
+  { "pool", rpc_pool },
+  { "encode", rpc_encode },
+  { "decode", rpc_decode },
+#ifdef LUARPC_ENABLE_FILE
+  { "file", rpc_file },
+#endif
+#ifdef LUARPC_ENABLE_PREFORK
+  { "prefork", rpc_prefork },
+#endif
 //  { "rpc_async", rpc_async },
   { NULL, NULL }
 };
@@ -455,6 +973,19 @@ LUALIB_API int luaopen_rpc(lua_State *L)
   lua_setfield(L, -2, "mode");
   register_client(L);
   luaL_newmetatable( L, "rpc.server_handle" );
+  luaL_register( L, NULL, rpc_server_handle );
+  lua_pop( L, 1 );
+
+  luaL_newmetatable( L, "rpc.pool" );
+  luaL_register( L, NULL, rpc_pool_map );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  lua_pop( L, 1 );
+
+  register_codec( L );
+#ifdef LUARPC_ENABLE_FILE
+  register_file( L );
+#endif
 
   return 1;
 }
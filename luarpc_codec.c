@@ -0,0 +1,288 @@
+// In-memory encoding
+//   rpc.encode( value [, options] ) returns the encoding of a value as a
+//   string and rpc.decode( s ) gives the value back. The encoding is what
+//   the value looks like on the wire, behind a header like the one of a
+//   session telling the byte order, number format and options it was made
+//   with, so it can be kept and decoded by another build. Options default to
+//   all that don't depend on a session, a table can turn them on or off by
+//   name: { compress = false, numarray = false, ... }.
+
+#include <string.h>
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+#include "platform_conf.h"
+
+#include "luarpc_rpc.h"
+
+#define CODEC_HEADER_SIZE ( 12 )
+#define CODEC_VERSION ( 4 ) // RPC_PROTOCOL_VERSION of the encoding
+
+static const struct {
+  const char *name;
+  u32 option;
+} codec_option_names[] = {
+  { "varint", RPC_OPT_VARINT },
+  { "shortstr", RPC_OPT_SHORTSTR },
+  { "array", RPC_OPT_ARRAY },
+  { "tablesize", RPC_OPT_TABLESIZE },
+  { "strref", RPC_OPT_STRREF },
+  { "tableref", RPC_OPT_TABLEREF },
+  { "compress", RPC_OPT_COMPRESS },
+  { "numarray", RPC_OPT_NUMARRAY },
+  { NULL, 0 }
+};
+
+static const char *codec_error( int n )
+{
+  switch( n )
+  {
+    case ERR_PROTOCOL: return "malformed encoding";
+    default: return transport_strerror( n );
+  }
+}
+
+// options from the table at the given index, or the default ones
+static u32 codec_options( lua_State *L, int index )
+{
+  u32 options = LUARPC_CODEC_OPTIONS;
+  int i;
+
+  if( lua_isnoneornil( L, index ) )
+    return options;
+  if( !lua_istable( L, index ) )
+    my_lua_error( L, "options argument must be a table" );
+
+  for( i = 0; codec_option_names[ i ].name != NULL; i ++ )
+  {
+    lua_getfield( L, index, codec_option_names[ i ].name );
+    if( !lua_isnil( L, -1 ) )
+    {
+      if( lua_toboolean( L, -1 ) )
+        options |= codec_option_names[ i ].option;
+      else
+        options &= ~codec_option_names[ i ].option;
+    }
+    lua_pop( L, 1 );
+  }
+  return options;
+}
+
+// **************************************************************************
+// codec transports
+//   a transport without a link holds the buffers. one is kept per lua state
+//   between calls, a call made while it is in use (i.e. from a __gc during
+//   another one) gets one of its own.
+
+static int codec_gc( lua_State *L )
+{
+  transport_buffer_reset( ( Transport * )luaL_checkudata( L, 1, "rpc.codec" ), L );
+  return 0;
+}
+
+// push the idle codec transport, taking it, or a new one
+static Transport *codec_take( lua_State *L )
+{
+  Transport *tpt;
+
+  lua_getfield( L, LUA_REGISTRYINDEX, "rpc.codec.idle" );
+  if( !lua_isnil( L, -1 ) )
+  {
+    lua_pushnil( L );
+    lua_setfield( L, LUA_REGISTRYINDEX, "rpc.codec.idle" );
+    return ( Transport * )lua_touserdata( L, -1 );
+  }
+  lua_pop( L, 1 );
+
+  tpt = ( Transport * )lua_newuserdata( L, sizeof( Transport ) );
+  transport_init( tpt );
+  tpt->memory = 1;
+  luaL_getmetatable( L, "rpc.codec" );
+  lua_setmetatable( L, -2 );
+  return tpt;
+}
+
+// make the codec transport at the given index the idle one again, large
+// buffers are released first
+static void codec_give( lua_State *L, int index )
+{
+  Transport *tpt = ( Transport * )lua_touserdata( L, index );
+
+  tpt->mode = 2;
+  if( tpt->zbuf_size > TRANSPORT_SCRATCH_KEEP || tpt->scratch_size > TRANSPORT_SCRATCH_KEEP )
+    transport_buffer_reset( tpt, L );
+  lua_pushvalue( L, index );
+  lua_setfield( L, LUA_REGISTRYINDEX, "rpc.codec.idle" );
+}
+
+// **************************************************************************
+// encoding and decoding
+//   the work is done in protected calls, so the codec transport is given
+//   back whatever happens. arguments are the value or string, the transport
+//   and for encoding the options.
+
+static int codec_encode( lua_State *L )
+{
+  Transport *tpt = ( Transport * )lua_touserdata( L, 2 );
+  struct exception e;
+  char header[ CODEC_HEADER_SIZE ];
+  luaL_Buffer b;
+  int x = 1, i;
+
+  tpt->options = ( u32 )lua_tonumber( L, 3 );
+  tpt->rd_little = tpt->net_little = tpt->loc_little = ( char )*( char * )&x;
+  tpt->lnum_bytes = ( char )sizeof( lua_Number );
+  tpt->net_intnum = tpt->loc_intnum = ( char )( ( ( lua_Number )0.5 ) == 0 );
+
+  Try
+  {
+    TRANSPORT_START_WRITING( tpt );
+    transport_encode( tpt, L, 1 );
+    TRANSPORT_STOP( tpt );
+  }
+  Catch( e )
+  {
+    return luaL_error( L, "%s", codec_error( e.errnum ) );
+  }
+
+  header[ 0 ] = 'L';
+  header[ 1 ] = 'R';
+  header[ 2 ] = 'P';
+  header[ 3 ] = 'C';
+  header[ 4 ] = CODEC_VERSION;
+  header[ 5 ] = tpt->loc_little;
+  header[ 6 ] = tpt->lnum_bytes;
+  header[ 7 ] = tpt->loc_intnum;
+  for( i = 0; i < 4; i ++ )
+    header[ 8 + i ] = ( char )( tpt->options >> ( 8 * i ) );
+
+  luaL_buffinit( L, &b );
+  luaL_addlstring( &b, header, sizeof( header ) );
+  luaL_addlstring( &b, ( const char * )tpt->zbuf, tpt->zbuf_len );
+  luaL_pushresult( &b );
+  return 1;
+}
+
+static int codec_decode( lua_State *L )
+{
+  Transport *tpt = ( Transport * )lua_touserdata( L, 2 );
+  struct exception e;
+  const char *s;
+  size_t len;
+  u32 options = 0;
+  int x = 1, i;
+
+  s = lua_tolstring( L, 1, &len );
+  if( len < CODEC_HEADER_SIZE || memcmp( s, "LRPC", 4 ) != 0 || s[ 4 ] != CODEC_VERSION )
+    return luaL_error( L, "not an rpc encoding" );
+  for( i = 0; i < 4; i ++ )
+    options |= ( u32 )( u8 )s[ 8 + i ] << ( 8 * i );
+  if( options & ~LUARPC_CODEC_OPTIONS )
+    return luaL_error( L, "encoding uses unknown options" );
+
+  // numbers are converted from integers of any size, floating point ones
+  // have to match
+  tpt->loc_little = ( char )*( char * )&x;
+  tpt->loc_intnum = ( char )( ( ( lua_Number )0.5 ) == 0 );
+  if( !s[ 7 ] && ( tpt->loc_intnum || ( u8 )s[ 6 ] != sizeof( lua_Number ) ) )
+    return luaL_error( L, "encoding has another number format" );
+  tpt->options = options;
+  tpt->net_little = tpt->loc_little;
+  tpt->rd_little = s[ 5 ] != 0;
+  tpt->lnum_bytes = s[ 6 ];
+  tpt->net_intnum = s[ 7 ] != 0;
+
+  Try
+  {
+    TRANSPORT_START_READING( tpt );
+    transport_decode( tpt, L, ( const u8 * )s + CODEC_HEADER_SIZE, len - CODEC_HEADER_SIZE );
+    TRANSPORT_STOP( tpt );
+  }
+  Catch( e )
+  {
+    return luaL_error( L, "%s", codec_error( e.errnum ) );
+  }
+  return 1;
+}
+
+// run f protected with the arguments of the caller, a codec transport
+// inserted as the second one
+static int codec_call( lua_State *L, lua_CFunction f )
+{
+  int status, i, n = lua_gettop( L );
+
+  codec_take( L );
+  lua_pushcfunction( L, f );
+  lua_pushvalue( L, 1 );
+  lua_pushvalue( L, n + 1 );
+  for( i = 2; i <= n; i ++ )
+    lua_pushvalue( L, i );
+  status = lua_pcall( L, n + 1, 1, 0 );
+  codec_give( L, n + 1 );
+  if( status != 0 )
+    lua_error( L );
+  return 1;
+}
+
+// rpc.encode( value [, options] )
+int rpc_encode( lua_State *L )
+{
+  u32 options;
+
+  luaL_checkany( L, 1 );
+  options = codec_options( L, 2 );
+  lua_settop( L, 1 );
+  lua_pushnumber( L, options );
+  return codec_call( L, codec_encode );
+}
+
+// rpc.decode( s )
+int rpc_decode( lua_State *L )
+{
+  luaL_checkstring( L, 1 );
+  lua_settop( L, 1 );
+  return codec_call( L, codec_decode );
+}
+
+// **************************************************************************
+// register the codec transport type
+
+#ifndef LUARPC_STANDALONE
+
+#define MIN_OPT_LEVEL 2
+#include "lrodefs.h"
+
+const LUA_REG_TYPE rpc_codec_map[] =
+{
+  { LSTRKEY( "__gc" ), LFUNCVAL( codec_gc ) },
+  { LNILKEY, LNILVAL }
+};
+
+void register_codec( lua_State *L )
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+  luaL_rometatable( L, "rpc.codec", ( void* )rpc_codec_map );
+#else
+  luaL_newmetatable( L, "rpc.codec" );
+  luaL_register( L, NULL, rpc_codec_map );
+  lua_pop( L, 1 );
+#endif
+}
+
+#else
+
+static const luaL_reg rpc_codec_map[] =
+{
+  { "__gc", codec_gc },
+  { NULL, NULL }
+};
+
+void register_codec( lua_State *L )
+{
+  luaL_newmetatable( L, "rpc.codec" );
+  luaL_register( L, NULL, rpc_codec_map );
+  lua_pop( L, 1 );
+}
+
+#endif
@@ -0,0 +1,478 @@
+// File payloads
+//   rpc.file( path [, offset [, length]] ) wraps a range of a file so it can
+//   be passed as an argument or return value without reading it into a lua
+//   string. On the wire it is a sized blob, streamed from the file descriptor
+//   to the link (with sendfile where the link is a socket). The receiving end
+//   spools the blob into an unlinked temporary file and gets an rpc.file
+//   again, which can be copied on with file:writeto( path or fd ).
+
+#if defined( __linux__ ) && !defined( _GNU_SOURCE )
+#define _GNU_SOURCE // pread, mkstemp, sendfile
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+#include "platform_conf.h"
+
+#include "luarpc_rpc.h"
+
+#ifdef LUARPC_ENABLE_FILE
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#define FILE_MAX_LENGTH ( ( u32 )-1 ) // longest range, lengths are sent as u32
+
+// **************************************************************************
+// file objects
+
+static File *file_check( lua_State *L, int index )
+{
+  return ( File * )luaL_checkudata( L, index, "rpc.file" );
+}
+
+static File *file_check_open( lua_State *L, int index )
+{
+  File *f = file_check( L, index );
+
+  if( f->fd < 0 )
+    luaL_error( L, "attempt to use a closed file" );
+  return f;
+}
+
+// push a new file object, its descriptor is closed when it is collected
+static File *file_push( lua_State *L, int fd, int64_t offset, u32 length )
+{
+  File *f = ( File * )lua_newuserdata( L, sizeof( File ) );
+
+  f->fd = fd;
+  f->offset = offset;
+  f->length = length;
+  luaL_getmetatable( L, "rpc.file" );
+  lua_setmetatable( L, -2 );
+  return f;
+}
+
+static void file_close( File *f )
+{
+  if( f->fd >= 0 )
+    close( f->fd );
+  f->fd = -1;
+}
+
+// return nil and a message like io.open does
+static int file_fail( lua_State *L, const char *what, int err )
+{
+  lua_pushnil( L );
+  lua_pushfstring( L, "%s: %s", what, strerror( err ) );
+  return 2;
+}
+
+// copy length bytes at offset in one file to the current position of another,
+// returns 0 or an errno value
+static int file_copy( int from, int64_t offset, int to, u32 length )
+{
+  char buf[ 8192 ], *p;
+  ssize_t n = 0, w;
+
+#ifdef __linux__
+  {
+    off_t off = offset;
+
+    // in kernel copy, file to file needs linux 2.6.33
+    while( length > 0 )
+    {
+      n = sendfile( to, from, &off, length );
+      if( n <= 0 )
+        break;
+      length -= n;
+    }
+    if( length == 0 )
+      return 0;
+    if( n == 0 )
+      return ERR_EOF;
+    if( errno != EINVAL && errno != ENOSYS )
+      return errno;
+    offset = off;
+  }
+#endif
+
+  while( length > 0 )
+  {
+    n = pread( from, buf, length < sizeof( buf ) ? length : sizeof( buf ), offset );
+    if( n <= 0 )
+      return n == 0 ? ERR_EOF : errno;
+    offset += n;
+    length -= n;
+    for( p = buf; n > 0; p += w, n -= w )
+    {
+      w = write( to, p, n );
+      if( w <= 0 )
+        return errno;
+    }
+  }
+  return 0;
+}
+
+// rpc_file( path [, offset [, length]] ) --> file
+//    opens a range of a file to be sent, by default up to the end of the
+//    file. returns nil and an error message if the file can't be opened.
+int rpc_file( lua_State *L )
+{
+  const char *path = luaL_checkstring( L, 1 );
+  lua_Number offset = luaL_optnumber( L, 2, 0 );
+  lua_Number length = luaL_optnumber( L, 3, -1 );
+  struct stat st;
+  int fd;
+
+  if( offset < 0 )
+    return luaL_argerror( L, 2, "negative offset" );
+
+  fd = open( path, O_RDONLY );
+  if( fd < 0 )
+    return file_fail( L, path, errno );
+  if( fstat( fd, &st ) != 0 )
+  {
+    int err = errno;
+    close( fd );
+    return file_fail( L, path, err );
+  }
+
+  if( length < 0 )
+    length = offset < st.st_size ? st.st_size - offset : 0;
+  if( offset + length > st.st_size || length > FILE_MAX_LENGTH )
+  {
+    close( fd );
+    return luaL_error( L, "range out of file or too long: %s", path );
+  }
+
+  file_push( L, fd, ( int64_t )offset, ( u32 )length );
+  return 1;
+}
+
+// file:size() --> length of the range
+static int file_size( lua_State *L )
+{
+  lua_pushnumber( L, file_check( L, 1 )->length );
+  return 1;
+}
+
+// file:read() --> string
+//    reads the whole range into a lua string
+static int file_read( lua_State *L )
+{
+  File *f = file_check_open( L, 1 );
+  char *buf = ( char * )malloc( f->length ? f->length : 1 );
+  u32 done = 0;
+  ssize_t n;
+
+  if( buf == NULL )
+    return luaL_error( L, "not enough memory for a file of %d bytes", ( int )f->length );
+
+  while( done < f->length )
+  {
+    n = pread( f->fd, buf + done, f->length - done, f->offset + done );
+    if( n <= 0 )
+    {
+      free( buf );
+      return file_fail( L, "read", n == 0 ? EIO : errno );
+    }
+    done += n;
+  }
+  lua_pushlstring( L, buf, f->length );
+  free( buf );
+  return 1;
+}
+
+// file:writeto( destination ) --> number of bytes written
+//    copies the range to a file, destination is a path (the file is created
+//    or truncated), a file descriptor number or an io library file. nothing
+//    is copied through a lua string.
+static int file_writeto( lua_State *L )
+{
+  File *f = file_check_open( L, 1 );
+  int fd, err;
+
+  if( lua_type( L, 2 ) == LUA_TSTRING )
+  {
+    const char *path = lua_tostring( L, 2 );
+
+    fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    if( fd < 0 )
+      return file_fail( L, path, errno );
+    err = file_copy( f->fd, f->offset, fd, f->length );
+    if( close( fd ) != 0 && err == 0 )
+      err = errno;
+  }
+  else if( lua_type( L, 2 ) == LUA_TNUMBER )
+    err = file_copy( f->fd, f->offset, ( int )lua_tonumber( L, 2 ), f->length );
+  else
+  {
+    FILE **fp = ( FILE ** )luaL_checkudata( L, 2, LUA_FILEHANDLE );
+
+    if( *fp == NULL )
+      return luaL_argerror( L, 2, "closed file" );
+    // earlier buffered writes go first
+    fflush( *fp );
+    err = file_copy( f->fd, f->offset, fileno( *fp ), f->length );
+  }
+
+  if( err != 0 )
+    return file_fail( L, "writeto", err == ERR_EOF ? EIO : err );
+  lua_pushnumber( L, f->length );
+  return 1;
+}
+
+// file:close(), also called when the object is collected
+static int file_close_method( lua_State *L )
+{
+  file_close( file_check( L, 1 ) );
+  return 0;
+}
+
+// **************************************************************************
+// file payloads on the transport
+
+// throw a fatal error, a payload that stops halfway leaves the link out of step
+static void file_throw( int errnum )
+{
+  struct exception e;
+
+  e.errnum = errnum;
+  e.type = fatal;
+  Throw( e );
+}
+
+// send the range of f. buffered output goes first, then the file contents
+// go to the link directly. in a value that is being compressed the contents
+// are copied in with the rest of it.
+void transport_write_file( Transport *tpt, File *f )
+{
+  int64_t offset = f->offset;
+  u32 length = f->length;
+  ssize_t n;
+  struct exception e;
+  TRANSPORT_VERIFY_OPEN;
+  TRANSPORT_VERIFY_WRITE;
+
+  if( tpt->capture )
+  {
+    u8 buf[ 4096 ];
+
+    while( length > 0 )
+    {
+      n = pread( f->fd, buf, length < sizeof( buf ) ? length : sizeof( buf ), offset );
+      if( n <= 0 )
+        file_throw( n == 0 ? ERR_EOF : errno );
+      transport_write_string( tpt, ( const char * )buf, n );
+      offset += n;
+      length -= n;
+    }
+    return;
+  }
+
+  transport_flush( tpt );
+
+#ifdef LUARPC_ENABLE_SENDFILE
+  n = transport_send_file( tpt, f->fd, offset, length );
+  offset += n;
+  length -= n;
+#endif
+
+  // the output buffer is empty after the flush, use it to copy the rest
+  while( length > 0 )
+  {
+    n = pread( f->fd, tpt->wbuf, length < TRANSPORT_WBUF_SIZE ? length : TRANSPORT_WBUF_SIZE, offset );
+    if( n <= 0 )
+      file_throw( n == 0 ? ERR_EOF : errno );
+    transport_write_buffer( tpt, tpt->wbuf, n );
+    offset += n;
+    length -= n;
+  }
+}
+
+// create an unlinked file to receive a payload into
+static int file_spool( void )
+{
+  const char *dir = getenv( "TMPDIR" );
+  char path[ 256 ];
+  int fd;
+
+  if( dir == NULL || *dir == 0 )
+    dir = "/tmp";
+  snprintf( path, sizeof( path ), "%s/luarpc-XXXXXX", dir );
+  fd = mkstemp( path );
+  if( fd < 0 )
+    file_throw( errno );
+  unlink( path );
+  return fd;
+}
+
+// write all of buffer to fd at offset
+static void file_put( int fd, const u8 *buffer, u32 length, int64_t offset )
+{
+  ssize_t n;
+
+  while( length > 0 )
+  {
+    n = pwrite( fd, buffer, length, offset );
+    if( n <= 0 )
+      file_throw( errno );
+    buffer += n;
+    length -= n;
+    offset += n;
+  }
+}
+
+// event driven servers spool a file payload as it arrives, ahead of decoding
+// the command it is in. the file object is kept for the decoder, which takes
+// the payloads in the same order.
+File *transport_spool_file( Transport *tpt, lua_State *L, u32 length )
+{
+  File *f;
+
+  if( tpt->files_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    tpt->files_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->files_ref );
+  f = file_push( L, -1, 0, length );
+  lua_rawseti( L, -2, ++ tpt->files_count );
+  lua_pop( L, 1 );
+
+  // the object owns the descriptor once it is kept
+  f->fd = file_spool();
+  return f;
+}
+
+// write the next bytes of a spooled payload, left counts those still to
+// come including them
+void transport_spool_put( File *f, const u8 *buffer, u32 length, u32 left )
+{
+  file_put( f->fd, buffer, length, ( int64_t )f->length - left );
+}
+
+// read a file payload of the given length into a spool file and push it as
+// a file object
+void transport_read_file( Transport *tpt, lua_State *L, u32 length )
+{
+  File *f;
+  int64_t offset = 0;
+  u32 n;
+  struct exception e;
+  TRANSPORT_VERIFY_OPEN;
+  TRANSPORT_VERIFY_READ;
+
+  // spooled while the command arrived, unless it is in a compressed value
+  if( tpt->files_ref != LUA_NOREF && tpt->rbuf != tpt->zbuf )
+  {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->files_ref );
+    lua_rawgeti( L, -1, ++ tpt->files_read );
+    lua_remove( L, -2 );
+    f = ( File * )lua_touserdata( L, -1 );
+    if( f == NULL || f->length != length )
+      file_throw( ERR_PROTOCOL );
+    return;
+  }
+
+  // the object owns the descriptor from here on, even if reading fails
+  f = file_push( L, file_spool(), 0, length );
+
+  // whatever was read ahead goes first, a decompressed value holds all of it
+  n = transport_buffered( tpt );
+  if( n > length )
+    n = length;
+  file_put( f->fd, tpt->rbuf + tpt->rbuf_pos, n, offset );
+  tpt->rbuf_pos += n;
+  offset += n;
+  length -= n;
+  if( length == 0 )
+    return;
+  if( tpt->rbuf != tpt->rbuf_mem )
+    file_throw( ERR_PROTOCOL );
+
+#ifdef LUARPC_ENABLE_SENDFILE
+  n = transport_recv_file( tpt, f->fd, offset, length );
+  offset += n;
+  length -= n;
+#endif
+
+  // the read-ahead buffer is drained, use it to copy the rest
+  tpt->rbuf_pos = tpt->rbuf_len = 0;
+  while( length > 0 )
+  {
+    n = transport_read_buffer( tpt, tpt->rbuf, length < TRANSPORT_RBUF_SIZE ? length : TRANSPORT_RBUF_SIZE );
+    file_put( f->fd, tpt->rbuf, n, offset );
+    offset += n;
+    length -= n;
+  }
+}
+
+// **************************************************************************
+// register file objects
+
+#ifndef LUARPC_STANDALONE
+
+#define MIN_OPT_LEVEL 2
+#include "lrodefs.h"
+
+const LUA_REG_TYPE rpc_file_map[] =
+{
+  { LSTRKEY( "size" ), LFUNCVAL( file_size ) },
+  { LSTRKEY( "read" ), LFUNCVAL( file_read ) },
+  { LSTRKEY( "writeto" ), LFUNCVAL( file_writeto ) },
+  { LSTRKEY( "close" ), LFUNCVAL( file_close_method ) },
+  { LSTRKEY( "__gc" ), LFUNCVAL( file_close_method ) },
+  { LSTRKEY( "__index" ), LROVAL( rpc_file_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+void register_file( lua_State *L )
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+  luaL_rometatable( L, "rpc.file", ( void* )rpc_file_map );
+#else
+  luaL_newmetatable( L, "rpc.file" );
+  luaL_register( L, NULL, rpc_file_map );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  lua_pop( L, 1 );
+#endif
+}
+
+#else
+
+static const luaL_reg rpc_file_map[] =
+{
+  { "size", file_size },
+  { "read", file_read },
+  { "writeto", file_writeto },
+  { "close", file_close_method },
+  { "__gc", file_close_method },
+  { NULL, NULL }
+};
+
+void register_file( lua_State *L )
+{
+  luaL_newmetatable( L, "rpc.file" );
+  luaL_register( L, NULL, rpc_file_map );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  lua_pop( L, 1 );
+}
+
+#endif
+
+#endif
@@ -11,17 +11,80 @@
 
 #define MAX_LINK_ERRS ( 2 ) // Maximum number of framing errors before connection reset
 
+#ifndef TRANSPORT_WBUF_SIZE
+#define TRANSPORT_WBUF_SIZE ( 4096 ) // Output buffer size, one message is flushed at a time
+#endif
+
+#ifndef TRANSPORT_WQ_LEN
+#define TRANSPORT_WQ_LEN ( 16 ) // Maximum number of blocks gathered into one write
+#endif
+
+#ifndef TRANSPORT_WREF_MIN
+#define TRANSPORT_WREF_MIN ( 1024 ) // Strings at least this long are sent in place, not copied
+#endif
+
+#ifndef TRANSPORT_RBUF_SIZE
+#define TRANSPORT_RBUF_SIZE ( 4096 ) // Read-ahead buffer size
+#endif
+
+#ifndef TRANSPORT_COMPRESS_MIN
+#define TRANSPORT_COMPRESS_MIN ( 512 ) // Values encoding to fewer bytes are never compressed
+#endif
+
+#ifndef TRANSPORT_PATH_IDS
+#define TRANSPORT_PATH_IDS ( 1024 ) // Function paths a server numbers per connection
+#endif
+
+#define TRANSPORT_FUNC_CACHE ( 64 ) // Functions a receiver keeps per session, both ends must agree
+
+#ifndef TRANSPORT_SCRATCH_KEEP
+#define TRANSPORT_SCRATCH_KEEP ( 65536 ) // Larger string decoding buffers are freed after use
+#endif
+
+#ifndef TRANSPORT_SCAN_DEPTH
+#define TRANSPORT_SCAN_DEPTH ( 4096 ) // Maximum number of open parts while scanning a command
+#endif
+
 #if defined( LUARPC_ENABLE_SERIAL )
 #define LUARPC_MODE "serial"
 #define tpt_handler ser_handler
 #elif defined( LUARPC_ENABLE_SOCKET )
 #define LUARPC_MODE "tcpip"
 typedef int tpt_handler;
+#if defined( __linux__ )
+#define LUARPC_ENABLE_EPOLL // serve many connections from one event loop
+#define MAXCON ( 128 ) // Default listen backlog
+#define MAX_EVENTS ( 64 ) // Maximum number of events handled per wait
+#define ACCEPT_BATCH ( 16 ) // Maximum number of connections accepted per event
+#define ACCEPT_RETRY ( 100 ) // ms before accepting again when out of descriptors
+#define LUARPC_ENABLE_PREFORK // rpc.prefork, workers share a port via SO_REUSEPORT
+#define LUARPC_ENABLE_SENDFILE // file payloads go from and to the socket with sendfile / splice
+#if !defined( LUARPC_DISABLE_IO_URING ) && defined( __has_include )
+#if __has_include( <linux/io_uring.h> )
+#define LUARPC_ENABLE_IO_URING // completion based server loop and calls, epoll if the kernel lacks it
+#define URING_ENTRIES ( 256 ) // Submission queue size of a server's ring
+#endif
+#endif
+#else
 #define MAXCON ( 1 )
+#endif
+#elif defined( LUARPC_ENABLE_SHM )
+#define LUARPC_MODE "shm"
+typedef int tpt_handler;
+#ifndef TRANSPORT_SHM_RING_SIZE
+#define TRANSPORT_SHM_RING_SIZE ( 1 << 20 ) // Bytes per direction, must be a power of 2
+#endif
+#ifndef TRANSPORT_SHM_SPIN
+#define TRANSPORT_SHM_SPIN ( 1000 ) // Polls of the ring before sleeping on a futex
+#endif
 #else
 #error "No RPC mode Selected.."
 #endif
 
+#if defined( LUARPC_STANDALONE ) && !defined( WIN32 )
+#define LUARPC_ENABLE_FILE // rpc.file, file payloads streamed without lua strings
+#endif
+
 // a kind of silly way to get the maximum int, but oh well ...
 #define MAXINT ((int)((((unsigned int)(-1)) << 1) >> 1))
 
@@ -88,6 +151,57 @@ extern struct exception_context the_exception_context[ 1 ];
 //****************************************************************************
 // LuaRPC Structures
 
+// Block of output handed to the link layer
+typedef struct _TransportVec TransportVec;
+struct _TransportVec
+{
+  const u8 *base;
+  u32       len;
+};
+
+// Session headers: "LRPC", the protocol version, byte order, number size and
+// kind, then from version 4 on the protocol options. Peers of version 3 send
+// and get the base header only and use no options.
+#define RPC_HEADER_BASE_SIZE ( 8 )
+#define RPC_HEADER_SIZE ( 12 )
+#define RPC_PROTOCOL_VERSION_MIN ( 3 )     // Oldest protocol version still spoken
+#define RPC_PROTOCOL_VERSION_OPTIONS ( 4 ) // First one with options in the header
+
+// Protocol options, agreed on when the headers are exchanged. Both ends
+// offer what they support and use what they have in common.
+enum {
+  RPC_OPT_VARINT = 1 << 0,            // integral numbers are sent as zigzag varints
+  RPC_OPT_SHORTSTR = 1 << 1,          // string lengths in the tag, or as u8 / u16
+  RPC_OPT_ARRAY = 1 << 2,             // sequence part of tables sent as bare values
+  RPC_OPT_TABLESIZE = 1 << 3,         // tables start with their number of entries
+  RPC_OPT_STRREF = 1 << 4,            // repeated strings within a table sent by number
+  RPC_OPT_PATHID = 1 << 5,            // functions called by a number the server assigns
+  RPC_OPT_TABLEREF = 1 << 6,          // tables seen before in a value sent by number
+  RPC_OPT_COMPRESS = 1 << 7,          // large values sent LZF compressed
+  RPC_OPT_NUMARRAY = 1 << 8,          // sequences of numbers sent as one packed block
+  RPC_OPT_NATIVE = 1 << 9,            // each end sends its own byte order, the reader converts
+  RPC_OPT_FUNCCACHE = 1 << 10         // functions the peer holds sent by their hash
+};
+
+#ifndef LUARPC_OPTIONS
+#ifdef LUARPC_ENABLE_SHM
+#define LUARPC_OPTIONS_LINK ( 0 ) // nothing to gain from compressing memory to memory
+#else
+#define LUARPC_OPTIONS_LINK ( RPC_OPT_COMPRESS )
+#endif
+#define LUARPC_OPTIONS ( RPC_OPT_VARINT | RPC_OPT_SHORTSTR | RPC_OPT_ARRAY | \
+                         RPC_OPT_TABLESIZE | RPC_OPT_STRREF | \
+                         RPC_OPT_PATHID | RPC_OPT_TABLEREF | \
+                         RPC_OPT_NUMARRAY | RPC_OPT_NATIVE | \
+                         RPC_OPT_FUNCCACHE | LUARPC_OPTIONS_LINK ) // Options offered by this build
+#endif
+
+// Options rpc.encode can use, those tied to a session are left out
+#define LUARPC_CODEC_OPTIONS ( RPC_OPT_VARINT | RPC_OPT_SHORTSTR | RPC_OPT_ARRAY | \
+                               RPC_OPT_TABLESIZE | RPC_OPT_STRREF | \
+                               RPC_OPT_TABLEREF | RPC_OPT_COMPRESS | \
+                               RPC_OPT_NUMARRAY )
+
 // Transport Connection Structure
 typedef struct _Transport Transport;
 struct _Transport 
@@ -97,10 +211,62 @@ struct _Transport
   u32    loc_little: 1,               // Local is little endian?
          loc_armflt: 1,               // local float representation is arm float?
          loc_intnum: 1,               // Local is integer only?
-         net_little: 1,               // Network is little endian?
+         net_little: 1,               // Data sent is little endian?
+         rd_little: 1,                // Data received is little endian?
          net_intnum: 1,               // Network is integer only?
+         memory: 1,                   // no link, values are encoded in memory
          mode: 2;                     // read (0) or write (1)
   u8     lnum_bytes;
+  u32    options;                     // negotiated protocol options (RPC_OPT_*)
+  u32    wbuf_len;                    // bytes waiting in the output buffer
+  u32    wbuf_seg;                    // start of output not yet in the send queue
+  u8     wbuf[ TRANSPORT_WBUF_SIZE ]; // output buffer, flushed when leaving write mode
+  int    wq_len;                      // blocks in the send queue
+  TransportVec wq[ TRANSPORT_WQ_LEN ]; // send queue, output buffer segments and lua strings
+  int    wq_ref[ TRANSPORT_WQ_LEN ];  // registry refs anchoring queued lua strings
+  lua_State *wq_L;                    // state holding the refs
+  u32    rbuf_pos;                    // next unread byte in the read-ahead buffer
+  u32    rbuf_len;                    // bytes held in the read-ahead buffer
+  u8    *rbuf;                        // bytes being decoded, rbuf_mem, a
+                                      // decompressed value in zbuf, memory
+                                      // given to transport_decode or gathered
+  u8     rbuf_mem[ TRANSPORT_RBUF_SIZE ]; // read-ahead buffer, refilled when drained
+  u8    *gathered;                    // gathered bytes of a command being read,
+                                      // followed by the read-ahead buffer, or NULL
+  u32    gathered_used;               // how many of them were read, once done
+  u32    rbuf_mem_pos;                // read-ahead position and length, put aside
+  u32    rbuf_mem_len;                // while gathered bytes are read
+  char  *scratch;                     // heap buffer for decoding strings
+  u32    scratch_size;                // allocated size of scratch (power of 2)
+  u8    *zbuf;                        // heap buffer for a value before compression
+                                      // or after decompression
+  u32    zbuf_size;                   // allocated size of zbuf (power of 2)
+  u32    zbuf_len;                    // bytes held in zbuf
+  int    capture;                     // nonzero while output goes to zbuf
+  int    refs_index;                  // stack index of the reference table of the value
+                                      // being sent or received, 0 if none
+  u32    refs_count;                  // strings and tables numbered in it so far
+  int    paths_ref;                   // numbered function paths of the session, ids by
+                                      // path on a client, key lists by id on a server
+  u32    paths_count;                 // paths numbered so far
+  u32    session;                     // number of the session, a new one whenever
+                                      // it is reset
+  int    funcs_ref;                   // functions received in the session and their
+                                      // code, in slots of a table
+  u32    funcs_count;                 // functions held in it
+  uint64_t funcs_hash[ TRANSPORT_FUNC_CACHE ]; // their hashes, most recent first
+  u8     funcs_slot[ TRANSPORT_FUNC_CACHE ];   // their slots, in the same order
+  u32    funcs_sent_count;            // functions the peer holds from us
+  uint64_t funcs_sent[ TRANSPORT_FUNC_CACHE ]; // their hashes, most recent first
+  int    files_ref;                   // file payloads spooled while the command
+                                      // being read arrived, in a table in order
+  u32    files_count;                 // payloads spooled
+  u32    files_read;                  // payloads taken by the decoder
+#ifdef LUARPC_ENABLE_SHM
+  struct _ShmRegion *shm;             // mapped ring pair, NULL if not mapped
+  u32    shm_side;                    // which end of the region this transport is
+  u32    shm_gen;                     // connection generation this end belongs to
+#endif
 };
 
 typedef struct _Handle Handle;
@@ -118,14 +284,114 @@ struct _Helper {
 	Helper *parent;                     // parent helper
   int pref;                           // Parent reference idx in registry
 	u8 nparents;                        // number of parents
+  u32 path_id;                        // number the server gave the path, if
+  u32 path_session;                   // learned in this session of the handle
   char funcname[NUM_FUNCNAME_CHARS];  // name of the function
 };
 
+typedef struct _Pool Pool;
+struct _Pool {
+  int args_ref;                       // connect arguments, table in registry
+  int idle_ref;                       // idle handles, table used as a stack
+  int nidle;                          // number of idle handles
+  int size;                           // number of handles kept ready
+};
+
+#ifdef LUARPC_ENABLE_FILE
+// Range of an open file passed as an argument or return value
+typedef struct _File File;
+struct _File {
+  int fd;                             // open file, -1 once closed
+  int64_t offset;                     // start of the range
+  u32 length;                         // length of the range
+};
+#endif
+
+// Resumable scan of a command
+//   finds where a command ends in the bytes that have arrived so far, without
+//   blocking or recursing. the parts still to come are kept on a stack, so
+//   the scan stops when the bytes run out and goes on when more arrive.
+enum {
+  TRANSPORT_SCAN_BYTES,               // count bytes
+  TRANSPORT_SCAN_STRING,              // u32 length and that many bytes
+  TRANSPORT_SCAN_UVARINT,             // a varint
+  TRANSPORT_SCAN_VARS,                // count values (as read by read_variable)
+  TRANSPORT_SCAN_ARGS,                // u32 count and that many values
+  TRANSPORT_SCAN_ELEMENTS,            // count values of a table's sequence part
+  TRANSPORT_SCAN_PAIRS,               // keys and values up to the end of a table
+  TRANSPORT_SCAN_BODY,                // values up to the end of a function
+  TRANSPORT_SCAN_HEADER               // a session header, its size told by its version
+};
+
+typedef struct _TransportScanItem TransportScanItem;
+struct _TransportScanItem
+{
+  int    item;                        // TRANSPORT_SCAN_*
+  uint64_t count;                     // values left, or 1 if a table key was seen
+};
+
+typedef struct _TransportScan TransportScan;
+struct _TransportScan
+{
+  u32    pos;                         // bytes of the command scanned so far
+  uint64_t skip;                      // bytes of a string or block still to pass
+  int    depth;                       // parts on the stack, the next one on top
+  int    size;                        // room for parts
+  TransportScanItem *stack;           // parts still to come
+  int    file;                        // set when the scan reached a file payload,
+                                      // which the caller takes from pos on
+  u32    file_left;                   // bytes of it still to come
+};
+
+typedef struct _ServerConn ServerConn;
+
 typedef struct _ServerHandle ServerHandle;
 struct _ServerHandle {
   Transport ltpt;   // listening transport, always valid if no error
   Transport atpt;   // accepting transport, valid if connection established
 	int link_errs;
+#ifdef LUARPC_ENABLE_EPOLL
+  int epfd;         // event multiplexer, connections go to conns if valid
+  ServerConn *conns; // accepted connections
+  int dispatching;   // set while the event loop serves connections
+  int accept_paused; // set while new connections wait for a free descriptor
+#endif
+#ifdef LUARPC_ENABLE_IO_URING
+  struct _TransportRing *ring; // io_uring instance behind epfd, NULL if epoll
+#endif
+};
+
+#ifdef LUARPC_ENABLE_EPOLL
+// Accepted connection of an event driven server
+struct _ServerConn {
+  Transport tpt;
+  int link_errs;
+  int negotiated;                     // nonzero once headers were exchanged
+  TransportScan scan;                 // how much of the next command has arrived
+  u8 *pend;                           // its bytes (and any after them), once it
+                                      // takes more than one read
+  u32 pend_len;                       // bytes held in pend
+  u32 pend_size;                      // allocated size of pend
+  int pend_run;                       // set while a command is read from pend
+#ifdef LUARPC_ENABLE_FILE
+  File *spool;                        // file payload of the command being received
+#endif
+  ServerConn *prev, *next;
+#ifdef LUARPC_ENABLE_IO_URING
+  int uring_state;                    // idle, receiving into tpt.rbuf, or ready
+  ServerConn *uring_next;             // link in the ring's idle or ready list
+#endif
+};
+#endif
+
+// Something rpc.wait sleeps on
+typedef struct _TransportPoll TransportPoll;
+struct _TransportPoll {
+  Transport *tpt;                     // data to read, or a connection to accept
+#ifdef LUARPC_ENABLE_EPOLL
+  ServerHandle *server;               // event driven server, used instead of tpt
+#endif
+  int ready;                          // set if there is something to do
 };
 
 
@@ -137,7 +403,7 @@ struct _ServerHandle {
 #endif
 
 #define TRANSPORT_VERIFY_OPEN \
-	if (tpt->fd == INVALID_TRANSPORT) \
+	if (tpt->fd == INVALID_TRANSPORT && !tpt->memory) \
 	{ \
 		e.errnum = ERR_CLOSED; \
 		e.type = fatal; \
@@ -180,20 +446,62 @@ int transport_open_connection(lua_State *L, Handle *handle);
 // Accept Connection 
 void transport_accept (Transport *tpt, Transport *atpt);
 
-// Read & Write to Transport 
-void transport_read_buffer (Transport *tpt, u8 *buffer, int length);
+// Read & Write to Transport (unbuffered link access, use the transport_read_*
+// and transport_write_* primitives instead)
+//    - read returns as soon as some data is available, with the number of
+//      bytes read (at least 1, never more than length)
+//    - write sends the whole buffer, write_vector sends all blocks in order
+int transport_read_buffer (Transport *tpt, u8 *buffer, int length);
 void transport_write_buffer (Transport *tpt, const u8 *buffer, int length);
+void transport_write_vector (Transport *tpt, const TransportVec *vec, int count);
 
-// Check if data is available on connection without reading:
+// Check if data is available on connection without reading (data already
+// held in the read-ahead buffer counts as available):
 // 		- 1 = data available, 0 = no data available
 int transport_readable (Transport *tpt);
 
+// Wait up to timeout ms (-1 = forever) until any of the entries has data
+// to read (or a connection to accept), marks them ready and returns how many
+int transport_poll (TransportPoll *p, int count, int timeout);
+
 // Check if transport is open:
 //		- 1 = connection open, 0 = connection closed
 int transport_is_open (Transport *tpt);
 
-// Shut down connection
-void transport_close (Transport *tpt);
+// Shut down connection, the lua state releases what the session held
+void transport_close (Transport *tpt, lua_State *L);
+
+#ifdef LUARPC_ENABLE_EPOLL
+// Wait up to timeout ms (-1 = forever) for activity on a server. New
+// connections are accepted on the way, up to max connections with data to
+// read are returned in ready.
+int transport_wait_events (ServerHandle *handle, ServerConn **ready, int max, int timeout);
+
+// Stop watching a connection before it is freed
+void transport_drop_events (ServerHandle *handle, ServerConn *conn);
+
+// Accept again after a connection was removed, if accepting ran out of
+// descriptors
+void transport_resume_accept (ServerHandle *handle);
+
+// Release the event multiplexer of a server
+void transport_close_events (ServerHandle *handle);
+#endif
+
+#ifdef LUARPC_ENABLE_IO_URING
+// Send vectors and receive at least one byte into buffer in one round trip,
+// returns the number of bytes received
+int transport_write_read (Transport *tpt, const TransportVec *vec, int count, u8 *buffer, int length);
+#endif
+
+#ifdef LUARPC_ENABLE_SENDFILE
+// Move up to length bytes between a file at offset and the link without
+// copying them through user space. Returns the number of bytes moved, which
+// is short if the kernel can't do it for these descriptors, the rest is then
+// copied by the caller.
+u32 transport_send_file (Transport *tpt, int fd, int64_t offset, u32 length);
+u32 transport_recv_file (Transport *tpt, int fd, int64_t offset, u32 length);
+#endif
 
 
 // added by edo
@@ -208,28 +516,68 @@ void transport_set_mode( Transport *tpt, int mode);
 #define TRANSPORT_START_READING(t) transport_set_mode((t),0)
 #define TRANSPORT_START_WRITING(t) transport_set_mode((t),1)
 #define TRANSPORT_STOP(t) transport_set_mode((t),2)
+void transport_flush( Transport *tpt );
+void transport_buffer_init( Transport *tpt );
+void transport_buffer_reset( Transport *tpt, lua_State *L );
+void transport_session_reset( Transport *tpt, lua_State *L );
+void transport_files_reset( Transport *tpt, lua_State *L );
+int transport_buffered( Transport *tpt );
 void transport_read_string( Transport *tpt, const char *buffer, int length );
+char *transport_read_scratch( Transport *tpt, u32 length );
 void transport_write_string( Transport *tpt, const char *buffer, int length );
 u8 transport_read_u8( Transport *tpt );
 void transport_write_u8( Transport *tpt, u8 x );
+u16 transport_read_u16( Transport *tpt );
+void transport_write_u16( Transport *tpt, u16 x );
 u32 transport_read_u32( Transport *tpt );
 void transport_write_u32( Transport *tpt, u32 x );
+uint64_t transport_read_uvarint( Transport *tpt );
+void transport_write_uvarint( Transport *tpt, uint64_t x );
 lua_Number transport_read_number( Transport *tpt );
 void transport_write_number( Transport *tpt, lua_Number x );
 void write_variable( Transport *tpt, lua_State *L, int var_index );
 int read_variable( Transport *tpt, lua_State *L );
+void transport_encode( Transport *tpt, lua_State *L, int var_index );
+void transport_decode( Transport *tpt, lua_State *L, const u8 *buffer, u32 length );
+void transport_read_ahead( Transport *tpt );
+void transport_gather( Transport *tpt, u8 *buffer, u32 length );
+void transport_gather_end( Transport *tpt );
+void transport_scan_init( TransportScan *s );
+void transport_scan_reset( TransportScan *s );
+void transport_scan_free( TransportScan *s );
+void transport_scan_push( TransportScan *s, int item, uint64_t count );
+int transport_scan( Transport *tpt, TransportScan *s, const u8 *buffer, u32 length );
 
 // luarpc
-void server_negotiate( Transport *tpt );
+void server_negotiate( Transport *tpt, lua_State *L );
 void helper_remote_index( Helper *helper ); //?!?
 int global_error_handler;
 
 // client
 void register_client(lua_State *L);
 
+#ifdef LUARPC_ENABLE_FILE
+// file payloads
+int rpc_file( lua_State *L );
+void register_file( lua_State *L );
+void transport_write_file( Transport *tpt, File *f );
+void transport_read_file( Transport *tpt, lua_State *L, u32 length );
+File *transport_spool_file( Transport *tpt, lua_State *L, u32 length );
+void transport_spool_put( File *f, const u8 *buffer, u32 length, u32 left );
+#endif
+
+// in-memory encoding
+int rpc_encode( lua_State *L );
+int rpc_decode( lua_State *L );
+void register_codec( lua_State *L );
+
 // server
 int rpc_dispatch( lua_State *L );
 void rpc_dispatch_helper( lua_State *L, ServerHandle *handle );
 ServerHandle *server_handle_create( lua_State *L );
-void server_handle_shutdown( ServerHandle *h );
-void server_handle_destroy( ServerHandle *h );
+void server_handle_shutdown( lua_State *L, ServerHandle *h );
+void server_handle_destroy( lua_State *L, ServerHandle *h );
+#ifdef LUARPC_ENABLE_EPOLL
+ServerConn *server_conn_add( ServerHandle *h );
+void server_conn_remove( lua_State *L, ServerHandle *h, ServerConn *c );
+#endif
@@ -25,6 +25,8 @@ void transport_open( Transport *tpt, const char *path );
 void transport_init (Transport *tpt)
 {
   tpt->fd = INVALID_TRANSPORT;
+  tpt->mode = 2;
+  transport_buffer_init( tpt );
 }
 
 void transport_open( Transport *tpt, const char *path )
@@ -80,36 +82,30 @@ void transport_accept (Transport *tpt, Transport *atpt)
 
 
 // Read & Write to Transport
-void transport_read_buffer (Transport *tpt, u8 *buffer, int length)
+int transport_read_buffer (Transport *tpt, u8 *buffer, int length)
 {
-  u32 n;
+  int n;
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
-  
-  while( length > 0 )
-  {
-    TRANSPORT_VERIFY_OPEN;
 
-    n = ser_read( tpt->fd, buffer, length );
+  n = ( int )ser_read( tpt->fd, buffer, length );
     
-    // error handling
-    if( n == 0 )
-    {
-      e.errnum = ERR_NODATA;
-      e.type = nonfatal;
-      Throw( e );
-    }
+  // error handling
+  if( n == 0 )
+  {
+    e.errnum = ERR_NODATA;
+    e.type = nonfatal;
+    Throw( e );
+  }
     
-    if( n < 0 )
-    {
-      e.errnum = transport_errno;
-      e.type = fatal;
-      Throw( e );
-    }
-   
-    buffer += n;
-    length -= n;
+  if( n < 0 )
+  {
+    e.errnum = transport_errno;
+    e.type = fatal;
+    Throw( e );
   }
+   
+  return n;
 }
 
 void transport_write_buffer( Transport *tpt, const u8 *buffer, int length )
@@ -128,6 +124,15 @@ void transport_write_buffer( Transport *tpt, const u8 *buffer, int length )
   }
 }
 
+// Serial links have no vectored writes, send blocks one at a time
+void transport_write_vector( Transport *tpt, const TransportVec *vec, int count )
+{
+  int i;
+
+  for( i = 0; i < count; i ++ )
+    transport_write_buffer( tpt, vec[ i ].base, vec[ i ].len );
+}
+
 // Check if data is available on connection without reading:
 //    - 1 = data available, 0 = no data available
 int transport_readable (Transport *tpt)
@@ -137,6 +142,9 @@ int transport_readable (Transport *tpt)
 
   if (tpt->fd == INVALID_TRANSPORT)
     return 0;
+
+  if( transport_buffered( tpt ) > 0 )
+    return 1;
   
   ret = ser_readable( tpt->fd );
   
@@ -150,6 +158,27 @@ int transport_readable (Transport *tpt)
   return ( ret > 0 );
 }
 
+// Wait for any of several transports
+//   serial ports can't be waited on together, they are checked in turn and
+//   each check waits as long as the serial layer does. with a timeout only
+//   one round is made.
+int transport_poll (TransportPoll *p, int count, int timeout)
+{
+  int i, n;
+
+  do
+  {
+    n = 0;
+    for( i = 0; i < count; i ++ )
+    {
+      p[ i ].ready = transport_readable( p[ i ].tpt );
+      n += p[ i ].ready;
+    }
+  } while( n == 0 && count > 0 && timeout < 0 );
+
+  return n;
+}
+
 // Check if transport is open:
 //    1 = connection open, 0 = connection closed
 int transport_is_open (Transport *tpt)
@@ -158,13 +187,14 @@ int transport_is_open (Transport *tpt)
 }
 
 // Shut down connection
-void transport_close (Transport *tpt)
+void transport_close (Transport *tpt, lua_State *L)
 {
   if (tpt->fd != INVALID_TRANSPORT)
   {
     ser_close( tpt->fd );
     tpt->fd = INVALID_TRANSPORT;
   }
+  transport_buffer_reset( tpt, L );
 }
 
 #endif // LUARPC_ENABLE_SERIAL
@@ -0,0 +1,469 @@
+// Shared memory transport
+//   A server creates a named POSIX shared memory region holding a pair of
+//   single producer / single consumer rings, one per direction. A client
+//   maps the same region by name. Bytes are copied straight into the peer's
+//   ring, waiting sides sleep on a futex in the region. Like the serial
+//   transport, one client is served at a time.
+
+#if defined( __linux__ ) && !defined( _GNU_SOURCE )
+#define _GNU_SOURCE // syscall, ftruncate
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+#include "platform_conf.h"
+
+#include "luarpc_rpc.h"
+
+#ifdef LUARPC_ENABLE_SHM
+
+#ifndef __linux__
+#error "shm transport needs linux futexes"
+#endif
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_MAGIC 0x4c525043 // "LRPC"
+#define SHM_NAME_MAX 64
+#define SHM_WAIT_MS 100 // futex timeout between checks that the peer is alive
+#define SHM_POLL_MS 1 // sleep between rounds of rpc.wait
+
+#if ( TRANSPORT_SHM_RING_SIZE & ( TRANSPORT_SHM_RING_SIZE - 1 ) ) != 0
+#error "TRANSPORT_SHM_RING_SIZE must be a power of 2"
+#endif
+
+// Connection states
+enum { SHM_FREE, SHM_CLAIMED, SHM_CONNECTED };
+
+// Transport ends
+enum { SHM_LISTENER, SHM_SERVER, SHM_CLIENT };
+
+// Rings: client to server, server to client
+enum { SHM_TO_SERVER, SHM_TO_CLIENT };
+
+// Head and tail are free running byte counts, kept on separate cache lines
+// so producer and consumer don't fight over them
+typedef struct _ShmRing ShmRing;
+struct _ShmRing
+{
+  u32 head;                           // bytes written, moved by the producer
+  u32 rwait;                          // consumer is (about to be) asleep on head
+  u32 closed;                         // producer has gone away
+  u8  pad1[ 64 - 3 * sizeof( u32 ) ];
+  u32 tail;                           // bytes read, moved by the consumer
+  u32 wwait;                          // producer is (about to be) asleep on tail
+  u8  pad2[ 64 - 2 * sizeof( u32 ) ];
+  u8  data[ TRANSPORT_SHM_RING_SIZE ];
+};
+
+typedef struct _ShmRegion ShmRegion;
+struct _ShmRegion
+{
+  u32   magic;
+  u32   size;                         // ring size, checked by clients
+  u32   state;                        // SHM_FREE, SHM_CLAIMED or SHM_CONNECTED
+  u32   gen;                          // bumped for every new client
+  pid_t server_pid;
+  pid_t client_pid;
+  char  name[ SHM_NAME_MAX ];         // unlinked when the listener closes
+  u8    pad[ 64 ];
+  ShmRing ring[ 2 ];
+};
+
+#define ATOMIC_LOAD( p ) __atomic_load_n( ( p ), __ATOMIC_SEQ_CST )
+#define ATOMIC_STORE( p, v ) __atomic_store_n( ( p ), ( v ), __ATOMIC_SEQ_CST )
+
+static void shm_throw( int errnum, enum exception_type type )
+{
+  struct exception e;
+  e.errnum = errnum;
+  e.type = type;
+  Throw( e );
+}
+
+static void futex_wait( u32 *addr, u32 val, int ms )
+{
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = ( ms % 1000 ) * 1000000L;
+  syscall( SYS_futex, addr, FUTEX_WAIT, val, ms < 0 ? NULL : &ts, NULL, 0 );
+}
+
+static void futex_wake( u32 *addr )
+{
+  syscall( SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0 );
+}
+
+static int pid_alive( pid_t pid )
+{
+  return pid > 0 && ( kill( pid, 0 ) == 0 || errno != ESRCH );
+}
+
+// Rings this end reads from and writes to
+static ShmRing *shm_in( Transport *tpt )
+{
+  return &tpt->shm->ring[ tpt->shm_side == SHM_CLIENT ? SHM_TO_CLIENT : SHM_TO_SERVER ];
+}
+
+static ShmRing *shm_out( Transport *tpt )
+{
+  return &tpt->shm->ring[ tpt->shm_side == SHM_CLIENT ? SHM_TO_SERVER : SHM_TO_CLIENT ];
+}
+
+// The connection is gone if another client took over the region or the
+// peer process died without closing
+static void shm_check_peer( Transport *tpt )
+{
+  ShmRegion *r = tpt->shm;
+  pid_t peer = tpt->shm_side == SHM_CLIENT ? r->server_pid : r->client_pid;
+
+  if( ATOMIC_LOAD( &r->gen ) != tpt->shm_gen || !pid_alive( peer ) )
+    shm_throw( ERR_EOF, nonfatal );
+}
+
+// Wait until *word differs from val, spinning briefly before sleeping.
+// *flag tells the other side to wake us.
+static void shm_wait( Transport *tpt, u32 *word, u32 val, u32 *flag )
+{
+  int i;
+
+  for( i = 0; i < TRANSPORT_SHM_SPIN; i ++ )
+    if( ATOMIC_LOAD( word ) != val )
+      return;
+
+  ATOMIC_STORE( flag, 1 );
+  while( ATOMIC_LOAD( word ) == val && !ATOMIC_LOAD( &shm_in( tpt )->closed ) )
+  {
+    futex_wait( word, val, SHM_WAIT_MS );
+    if( ATOMIC_LOAD( word ) == val )
+      shm_check_peer( tpt );
+  }
+  ATOMIC_STORE( flag, 0 );
+}
+
+static void shm_map( Transport *tpt, int fd, u32 side )
+{
+  void *p = mmap( NULL, sizeof( ShmRegion ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+
+  if( p == MAP_FAILED )
+  {
+    int err = errno;
+    close( fd );
+    shm_throw( err, fatal );
+  }
+  tpt->fd = fd;
+  tpt->shm = ( ShmRegion * )p;
+  tpt->shm_side = side;
+}
+
+static int shm_name( lua_State *L, char *name )
+{
+  const char *id;
+  size_t len;
+
+  if ( !lua_isstring( L, 1 ) )
+    luaL_error( L, "first argument must be a shared memory name" );
+  id = lua_tolstring( L, 1, &len );
+  if( id[ 0 ] == '/' )
+  {
+    id ++;
+    len --;
+  }
+  if( len == 0 || len + 2 > SHM_NAME_MAX || strchr( id, '/' ) )
+    luaL_error( L, "bad shared memory name" );
+
+  name[ 0 ] = '/';
+  memcpy( name + 1, id, len + 1 );
+  return 1;
+}
+
+// Setup Transport
+void transport_init (Transport *tpt)
+{
+  tpt->fd = INVALID_TRANSPORT;
+  tpt->shm = NULL;
+  tpt->shm_gen = 0;
+  tpt->mode = 2;
+  transport_buffer_init( tpt );
+}
+
+// Open Listener / Server
+//   creates the region, replacing one left over by an old server
+void transport_open_listener(lua_State *L, ServerHandle *handle)
+{
+  char name[ SHM_NAME_MAX ];
+  ShmRegion *r;
+  int fd;
+
+  check_num_args (L,2); // 1st arg is name, 2nd is handle
+  shm_name( L, name );
+
+  fd = shm_open( name, O_RDWR | O_CREAT | O_TRUNC, 0600 );
+  if( fd < 0 )
+    shm_throw( transport_errno, fatal );
+  if( ftruncate( fd, sizeof( ShmRegion ) ) != 0 )
+  {
+    int err = errno;
+    close( fd );
+    shm_unlink( name );
+    shm_throw( err, fatal );
+  }
+
+  shm_map( &handle->ltpt, fd, SHM_LISTENER );
+  r = handle->ltpt.shm;
+  strcpy( r->name, name );
+  r->size = TRANSPORT_SHM_RING_SIZE;
+  r->server_pid = getpid();
+  r->state = SHM_FREE;
+  r->gen = 1;
+  ATOMIC_STORE( &r->magic, SHM_MAGIC );
+}
+
+// Open Connection / Client
+//   claims the region, resets both rings and wakes the server
+int transport_open_connection(lua_State *L, Handle *handle)
+{
+  char name[ SHM_NAME_MAX ];
+  Transport *tpt = &handle->tpt;
+  ShmRegion *r;
+  u32 state = SHM_FREE;
+  int fd, i;
+
+  check_num_args (L,2); // 1st arg is name, 2nd is handle
+  shm_name( L, name );
+
+  fd = shm_open( name, O_RDWR, 0 );
+  if( fd < 0 )
+    shm_throw( transport_errno, fatal );
+
+  shm_map( tpt, fd, SHM_CLIENT );
+  r = tpt->shm;
+  if( ATOMIC_LOAD( &r->magic ) != SHM_MAGIC || r->size != TRANSPORT_SHM_RING_SIZE )
+    shm_throw( ERR_HEADER, fatal );
+  if( !pid_alive( r->server_pid ) )
+    shm_throw( ECONNREFUSED, fatal );
+  if( !__atomic_compare_exchange_n( &r->state, &state, SHM_CLAIMED, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ) )
+    shm_throw( EBUSY, fatal );
+
+  for( i = 0; i < 2; i ++ )
+  {
+    r->ring[ i ].head = r->ring[ i ].tail = 0;
+    r->ring[ i ].rwait = r->ring[ i ].wwait = 0;
+    r->ring[ i ].closed = 0;
+  }
+  r->client_pid = getpid();
+  tpt->shm_gen = ATOMIC_LOAD( &r->gen ) + 1;
+  ATOMIC_STORE( &r->gen, tpt->shm_gen );
+  ATOMIC_STORE( &r->state, SHM_CONNECTED );
+  futex_wake( &r->state );
+
+  return 1;
+}
+
+// Accept Connection
+//   waits for a client to connect, the accepted end gets its own mapping
+void transport_accept (Transport *tpt, Transport *atpt)
+{
+  struct exception e;
+  int fd;
+  TRANSPORT_VERIFY_OPEN;
+
+  while( ATOMIC_LOAD( &tpt->shm->state ) != SHM_CONNECTED )
+    futex_wait( &tpt->shm->state, ATOMIC_LOAD( &tpt->shm->state ), -1 );
+
+  fd = dup( tpt->fd );
+  if( fd < 0 )
+    shm_throw( transport_errno, fatal );
+  shm_map( atpt, fd, SHM_SERVER );
+  atpt->shm_gen = ATOMIC_LOAD( &atpt->shm->gen );
+}
+
+// Read & Write to Transport
+int transport_read_buffer (Transport *tpt, u8 *buffer, int length)
+{
+  struct exception e;
+  ShmRing *ring;
+  u32 head, tail, off, n, first;
+  TRANSPORT_VERIFY_OPEN;
+
+  ring = shm_in( tpt );
+  tail = ring->tail;
+  head = ATOMIC_LOAD( &ring->head );
+  if( head == tail )
+  {
+    shm_wait( tpt, &ring->head, tail, &ring->rwait );
+    head = ATOMIC_LOAD( &ring->head );
+    if( head == tail ) // woken by close
+      shm_throw( ERR_EOF, nonfatal );
+  }
+
+  n = head - tail;
+  if( n > ( u32 )length )
+    n = length;
+  off = tail & ( TRANSPORT_SHM_RING_SIZE - 1 );
+  first = TRANSPORT_SHM_RING_SIZE - off;
+  if( first > n )
+    first = n;
+  memcpy( buffer, ring->data + off, first );
+  memcpy( buffer + first, ring->data, n - first );
+
+  ATOMIC_STORE( &ring->tail, tail + n );
+  if( ATOMIC_LOAD( &ring->wwait ) )
+    futex_wake( &ring->tail );
+
+  return ( int )n;
+}
+
+void transport_write_buffer( Transport *tpt, const u8 *buffer, int length )
+{
+  struct exception e;
+  ShmRing *ring;
+  u32 head, tail, off, n, first;
+  TRANSPORT_VERIFY_OPEN;
+
+  ring = shm_out( tpt );
+  head = ring->head;
+  while( length > 0 )
+  {
+    tail = ATOMIC_LOAD( &ring->tail );
+    if( head - tail == TRANSPORT_SHM_RING_SIZE )
+    {
+      shm_wait( tpt, &ring->tail, tail, &ring->wwait );
+      if( ATOMIC_LOAD( &ring->tail ) == tail ) // woken by close
+        shm_throw( ERR_EOF, nonfatal );
+      continue;
+    }
+
+    n = TRANSPORT_SHM_RING_SIZE - ( head - tail );
+    if( n > ( u32 )length )
+      n = length;
+    off = head & ( TRANSPORT_SHM_RING_SIZE - 1 );
+    first = TRANSPORT_SHM_RING_SIZE - off;
+    if( first > n )
+      first = n;
+    memcpy( ring->data + off, buffer, first );
+    memcpy( ring->data, buffer + first, n - first );
+
+    head += n;
+    buffer += n;
+    length -= n;
+    ATOMIC_STORE( &ring->head, head );
+    if( ATOMIC_LOAD( &ring->rwait ) )
+      futex_wake( &ring->head );
+  }
+}
+
+// Copying into the ring is the same cost either way, send blocks one at a time
+void transport_write_vector( Transport *tpt, const TransportVec *vec, int count )
+{
+  int i;
+
+  for( i = 0; i < count; i ++ )
+    transport_write_buffer( tpt, vec[ i ].base, vec[ i ].len );
+}
+
+// Check if data is available on connection without reading:
+//    - 1 = data available, 0 = no data available
+//    - a listener is readable when a client is waiting to be accepted
+int transport_readable (Transport *tpt)
+{
+  ShmRing *ring;
+
+  if (tpt->fd == INVALID_TRANSPORT)
+    return 0;
+
+  if( transport_buffered( tpt ) > 0 )
+    return 1;
+
+  if( tpt->shm_side == SHM_LISTENER )
+    return ATOMIC_LOAD( &tpt->shm->state ) == SHM_CONNECTED;
+
+  ring = shm_in( tpt );
+  return ATOMIC_LOAD( &ring->head ) != ring->tail || ATOMIC_LOAD( &ring->closed );
+}
+
+// Wait for any of several transports
+//   rings can't be slept on together, they are checked in turn, spinning
+//   first like a read does and then sleeping SHM_POLL_MS between rounds
+int transport_poll (TransportPoll *p, int count, int timeout)
+{
+  struct timespec ts;
+  int i, n, spin = 0, slept = 0;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = SHM_POLL_MS * 1000000L;
+  for( ;; )
+  {
+    n = 0;
+    for( i = 0; i < count; i ++ )
+    {
+      p[ i ].ready = transport_readable( p[ i ].tpt );
+      n += p[ i ].ready;
+    }
+    if( n > 0 || timeout == 0 || ( timeout > 0 && slept >= timeout ) )
+      return n;
+
+    if( spin < TRANSPORT_SHM_SPIN )
+      spin ++;
+    else
+    {
+      nanosleep( &ts, NULL );
+      slept += SHM_POLL_MS;
+    }
+  }
+}
+
+// Check if transport is open:
+//    1 = connection open, 0 = connection closed
+int transport_is_open (Transport *tpt)
+{
+  return (tpt->fd != INVALID_TRANSPORT);
+}
+
+// Shut down connection
+//   the peer sees end of file, a closing server end frees the region for
+//   the next client and a closing listener removes its name
+void transport_close (Transport *tpt, lua_State *L)
+{
+  if (tpt->fd != INVALID_TRANSPORT)
+  {
+    ShmRegion *r = tpt->shm;
+
+    if( tpt->shm_side == SHM_LISTENER )
+    {
+      ATOMIC_STORE( &r->server_pid, 0 );
+      shm_unlink( r->name );
+    }
+    else if( ATOMIC_LOAD( &r->gen ) == tpt->shm_gen )
+    {
+      ShmRing *out = shm_out( tpt );
+      ATOMIC_STORE( &out->closed, 1 );
+      futex_wake( &out->head );
+      if( tpt->shm_side == SHM_SERVER )
+        ATOMIC_STORE( &r->state, SHM_FREE );
+    }
+
+    munmap( r, sizeof( ShmRegion ) );
+    close( tpt->fd );
+    tpt->fd = INVALID_TRANSPORT;
+    tpt->shm = NULL;
+  }
+  transport_buffer_reset( tpt, L );
+}
+
+#endif // LUARPC_ENABLE_SHM
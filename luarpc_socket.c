@@ -5,6 +5,10 @@
 * see the file LICENSE that comes with this distribution.                    *
 *****************************************************************************/
 
+#if defined( __linux__ ) && !defined( _GNU_SOURCE )
+#define _GNU_SOURCE /* accept4, splice */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -26,9 +30,22 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 #endif /* END NEEDED INCLUDES W/ SOCKETS */
 
@@ -39,6 +56,11 @@
 #include "platform_conf.h"
 #include "luarpc_rpc.h"
 
+#ifdef LUARPC_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#endif
+
 #ifdef LUARPC_ENABLE_SOCKET
 
 
@@ -170,6 +192,74 @@ static int get_port_number (lua_State *L, int i)
   return port;
 }
 
+#ifndef WIN32
+
+#define UNIX_PREFIX "unix:"
+
+/* check if a given stack value is a "unix:/path" identifier for a unix domain
+ * socket. if so fill in the address and return 1, otherwise return 0.
+ */
+
+static int get_unix_address (lua_State *L, int i, struct sockaddr_un *addr)
+{
+  const char *id;
+  size_t len;
+  if (lua_type (L,i) != LUA_TSTRING) return 0;
+
+  id = lua_tolstring (L,i,&len);
+  if (len < sizeof (UNIX_PREFIX) - 1 ||
+      memcmp (id,UNIX_PREFIX,sizeof (UNIX_PREFIX) - 1) != 0)
+    return 0;
+  id += sizeof (UNIX_PREFIX) - 1;
+  len -= sizeof (UNIX_PREFIX) - 1;
+
+  if (len == 0) my_lua_error (L,"unix socket path is empty");
+  if (len >= sizeof (addr->sun_path)) my_lua_error (L,"unix socket path is too long");
+
+  memset (addr,0,sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy (addr->sun_path,id,len);
+  return 1;
+}
+
+#endif
+
+/* read a numeric field from an options table at the given stack index, the
+ * default is returned if there is no table (index 0 or nil) or the field is
+ * not set.
+ */
+
+static lua_Number get_option_number (lua_State *L, int i, const char *name, lua_Number def)
+{
+  lua_Number value = def;
+  if (i == 0 || lua_isnil (L,i)) return def;
+  if (!lua_istable (L,i)) my_lua_error (L,"options argument must be a table");
+
+  lua_getfield (L,i,name);
+  if (!lua_isnil (L,-1)) {
+    if (!lua_isnumber (L,-1))
+      luaL_error (L,"option '%s' must be a number",name);
+    value = lua_tonumber (L,-1);
+  }
+  lua_pop (L,1);
+  return value;
+}
+
+/* read a boolean field from an options table, same rules as above. */
+
+static int get_option_boolean (lua_State *L, int i, const char *name, int def)
+{
+  int value = def;
+  if (i == 0 || lua_isnil (L,i)) return def;
+  if (!lua_istable (L,i)) my_lua_error (L,"options argument must be a table");
+
+  lua_getfield (L,i,name);
+  if (!lua_isnil (L,-1))
+    value = lua_toboolean (L,-1);
+  lua_pop (L,1);
+  return value;
+}
+
 /****************************************************************************/
 /* socket reading and writing functions.
  * the socket functions throw exceptions if there are errors, so you must call
@@ -182,6 +272,8 @@ static int get_port_number (lua_State *L, int i)
 void transport_init (Transport *tpt)
 {
   tpt->fd = INVALID_TRANSPORT;
+  tpt->mode = 2;
+  transport_buffer_init (tpt);
 }
 
 /* see if a socket is open */
@@ -207,12 +299,78 @@ void transport_open (Transport *tpt)
   setsockopt( tpt->fd, IPPROTO_TCP, TCP_NODELAY, ( char * )&flag, sizeof( int ) );
 }
 
+#ifndef WIN32
+
+/* open a unix domain stream socket. */
+
+static void transport_open_unix (Transport *tpt)
+{
+  struct exception e;
+  tpt->fd = socket (AF_UNIX,SOCK_STREAM,0);
+  if (tpt->fd == INVALID_TRANSPORT)
+  {
+    e.errnum = sock_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+}
+
+/* connect or bind a unix domain socket to a path. a socket file left behind
+ * by a previous server is removed before binding if nothing accepts on it,
+ * one a running server listens on is left alone.
+ */
+
+static void transport_connect_unix (Transport *tpt, struct sockaddr_un *addr)
+{
+  struct exception e;
+  TRANSPORT_VERIFY_OPEN;
+  if (connect (tpt->fd,(struct sockaddr *) addr,sizeof (*addr)) != 0)
+  {
+    e.errnum = sock_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+}
+
+static void transport_bind_unix (Transport *tpt, struct sockaddr_un *addr)
+{
+  struct exception e;
+  struct stat st;
+  int fd, err;
+  TRANSPORT_VERIFY_OPEN;
+  if (stat (addr->sun_path,&st) == 0 && S_ISSOCK (st.st_mode)) {
+    fd = socket (AF_UNIX,SOCK_STREAM,0);
+    if (fd < 0)
+      err = sock_errno;
+    else {
+      err = (connect (fd,(struct sockaddr *) addr,sizeof (*addr)) != 0) ? sock_errno : 0;
+      close (fd);
+    }
+    if (err == ECONNREFUSED)
+      unlink (addr->sun_path);
+    else if (err == 0) {
+      e.errnum = EADDRINUSE;
+      e.type = fatal;
+      Throw( e );
+    }
+  }
+  if (bind (tpt->fd,(struct sockaddr *) addr,sizeof (*addr)) != 0)
+  {
+    e.errnum = sock_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+}
+
+#endif
+
 /* close a socket */
 
-void transport_close (Transport *tpt)
+void transport_close (Transport *tpt, lua_State *L)
 {
   if (tpt->fd != INVALID_TRANSPORT) close (tpt->fd);
   tpt->fd = INVALID_TRANSPORT;
+  transport_buffer_reset (tpt,L);
 }
 
 
@@ -254,6 +412,29 @@ static void transport_bind (Transport *tpt, u32 ip_address, u16 ip_port)
 }
 
 
+/* let several sockets bind the same port, the kernel spreads incoming
+ * connections across them. used by preforked servers.
+ */
+
+static void transport_reuseport (Transport *tpt)
+{
+  struct exception e;
+  TRANSPORT_VERIFY_OPEN;
+#ifdef SO_REUSEPORT
+  {
+    int flag = 1;
+    if (setsockopt (tpt->fd,SOL_SOCKET,SO_REUSEPORT,(char *) &flag,sizeof (int)) == 0)
+      return;
+    e.errnum = sock_errno;
+  }
+#else
+  e.errnum = ENOPROTOOPT;
+#endif
+  e.type = fatal;
+  Throw( e );
+}
+
+
 /* listen for incoming connections, with up to `maxcon' connections
  * queued up.
  */
@@ -277,7 +458,7 @@ static void transport_listen (Transport *tpt, int maxcon)
 void transport_accept (Transport *tpt, Transport *atpt)
 {
   struct exception e;
-  struct sockaddr_in clientname;
+  struct sockaddr_storage clientname;
   socklen_t namesize;
   TRANSPORT_VERIFY_OPEN;
   namesize = sizeof( clientname );
@@ -291,59 +472,566 @@ void transport_accept (Transport *tpt, Transport *atpt)
 }
 
 
-/* read from the socket into a buffer */
+/* read from the socket into a buffer. this blocks until some data is
+ * available and returns the number of bytes read.
+ */
+
+int transport_read_buffer (Transport *tpt, u8 *buffer, int length)
+{
+  struct exception e;
+  int n;
+  TRANSPORT_VERIFY_OPEN;
+  n = read (tpt->fd,(void*) buffer,length);
+  if (n == 0) 
+  {
+    e.errnum = ERR_EOF;
+    e.type = nonfatal;
+    Throw( e );
+  }
+
+  if (n < 0) 
+  {
+    e.errnum = sock_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+
+  return n;
+}
 
-void transport_read_buffer (Transport *tpt, u8 *buffer, int length)
+/* write a buffer to the socket */
+
+void transport_write_buffer (Transport *tpt, const u8 *buffer, int length)
 {
-   struct exception e;
+  struct exception e;
+  int n;
   TRANSPORT_VERIFY_OPEN;
   while (length > 0) {
-    int n = read (tpt->fd,(void*) buffer,length);
-    if (n == 0) 
+    n = write (tpt->fd,buffer,length);
+    if (n <= 0) 
     {
-      e.errnum = ERR_EOF;
-      e.type = nonfatal;
+      e.errnum = sock_errno;
+      e.type = fatal;
       Throw( e );
     }
 
-    if (n < 0) 
+    buffer += n;
+    length -= n;
+  }
+}
+
+/* write a list of buffers to the socket with as few system calls as possible */
+
+void transport_write_vector (Transport *tpt, const TransportVec *vec, int count)
+{
+  struct exception e;
+  struct iovec iov[ TRANSPORT_WQ_LEN ];
+  struct iovec *next = iov;
+  int i, n;
+  TRANSPORT_VERIFY_OPEN;
+
+  for (i = 0; i < count; i++) {
+    iov[ i ].iov_base = (void *) vec[ i ].base;
+    iov[ i ].iov_len = vec[ i ].len;
+  }
+
+  while (count > 0) {
+    n = writev (tpt->fd,next,count);
+    if (n <= 0) 
     {
       e.errnum = sock_errno;
       e.type = fatal;
       Throw( e );
     }
 
-    buffer += n;
-    length -= n;
+    /* skip what was written, resume partial blocks where they stopped */
+    while (count > 0 && (size_t) n >= next->iov_len) {
+      n -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (char *) next->iov_base + n;
+      next->iov_len -= n;
+    }
   }
 }
 
-/* write a buffer to the socket */
+#ifdef LUARPC_ENABLE_SENDFILE
+#define SPLICE_PIPE_SIZE (1 << 20) /* pipe size asked for when receiving files */
 
-void transport_write_buffer (Transport *tpt, const u8 *buffer, int length)
+/* send part of a file straight from the page cache */
+
+u32 transport_send_file (Transport *tpt, int fd, int64_t offset, u32 length)
 {
   struct exception e;
-  int n;
+  off_t off = offset;
+  u32 sent = 0;
+  ssize_t n;
+  TRANSPORT_VERIFY_OPEN;
+
+  while (sent < length) {
+    n = sendfile (tpt->fd,fd,&off,length - sent);
+    if (n < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS))
+      return 0; /* not a file sendfile can read, copied by the caller */
+    if (n <= 0)
+    {
+      e.errnum = n == 0 ? ERR_EOF : sock_errno;
+      e.type = fatal;
+      Throw( e );
+    }
+    sent += n;
+  }
+  return sent;
+}
+
+/* receive into part of a file, the data is spliced through a pipe so it
+ * never passes through user space */
+
+static void transport_recv_file_fail (int *p, int errnum)
+{
+  struct exception e;
+  close (p[ 0 ]);
+  close (p[ 1 ]);
+  e.errnum = errnum;
+  e.type = fatal;
+  Throw( e );
+}
+
+u32 transport_recv_file (Transport *tpt, int fd, int64_t offset, u32 length)
+{
+  struct exception e;
+  loff_t off = offset;
+  u32 done = 0;
+  ssize_t n, m;
+  int p[ 2 ];
+  TRANSPORT_VERIFY_OPEN;
+
+  if (pipe (p) != 0)
+    return 0;
+#ifdef F_SETPIPE_SZ
+  fcntl (p[ 1 ],F_SETPIPE_SZ,SPLICE_PIPE_SIZE); /* fewer round trips, best effort */
+#endif
+
+  while (done < length) {
+    n = splice (tpt->fd,NULL,p[ 1 ],NULL,length - done,SPLICE_F_MOVE);
+    if (n < 0 && done == 0 && errno == EINVAL)
+      break; /* socket can't be spliced, copied by the caller */
+    if (n <= 0)
+      transport_recv_file_fail (p,n == 0 ? ERR_EOF : sock_errno);
+
+    /* the pipe holds data taken off the link, it has to reach the file */
+    while (n > 0) {
+      m = splice (p[ 0 ],NULL,fd,&off,n,SPLICE_F_MOVE);
+      if (m <= 0)
+        transport_recv_file_fail (p,m == 0 ? ERR_EOF : errno);
+      n -= m;
+      done += m;
+    }
+  }
+
+  close (p[ 0 ]);
+  close (p[ 1 ]);
+  return done;
+}
+#endif
+
+/****************************************************************************/
+/* io_uring. rings are set up with raw system calls, no library is needed.
+ * a client call posts the send of its request and the receive of the reply
+ * in one system call. servers wait for completions instead of readiness, see
+ * the event driven server below. if the kernel refuses a ring, the plain
+ * socket calls are used.
+ */
+
+#ifdef LUARPC_ENABLE_IO_URING
+
+#define URING_LISTENER ((__u64) 0) /* user_data of a server's accept */
+#define URING_IGNORE ((__u64) 1)   /* user_data of cancel and timeout requests */
+
+enum { URING_IDLE, URING_RECEIVING, URING_READY };
+
+typedef struct _TransportRing TransportRing;
+struct _TransportRing {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+  unsigned queued;                  /* entries prepared, not yet submitted */
+  int accepting;                    /* server: accept in flight */
+  ServerConn *idle;                 /* server: handed out by the last wait */
+  ServerConn *ready, *ready_tail;   /* server: received data, not handed out */
+};
+
+static void *uring_map (int fd, size_t len, off_t offset)
+{
+  void *p = mmap (NULL,len,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,offset);
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void uring_destroy (TransportRing *r)
+{
+  if (r->sqes) munmap (r->sqes,r->sqes_len);
+  if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap (r->cq_ptr,r->cq_len);
+  if (r->sq_ptr) munmap (r->sq_ptr,r->sq_len);
+  close (r->fd);
+  free (r);
+}
+
+/* set up a ring, NULL if the kernel lacks io_uring or any of the features */
+
+static TransportRing *uring_create (unsigned entries, unsigned features)
+{
+  struct io_uring_params p;
+  TransportRing *r;
+  int fd;
+
+  memset (&p,0,sizeof (p));
+  fd = (int) syscall (__NR_io_uring_setup,entries,&p);
+  if (fd < 0) return NULL;
+  if ((p.features & features) != features ||
+      (r = (TransportRing *) calloc (1,sizeof (TransportRing))) == NULL) {
+    close (fd);
+    return NULL;
+  }
+
+  r->fd = fd;
+  r->entries = p.sq_entries;
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+    r->cq_len = r->sq_len;
+  }
+  r->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+
+  r->sq_ptr = uring_map (fd,r->sq_len,IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ptr = r->sq_ptr;
+  else
+    r->cq_ptr = uring_map (fd,r->cq_len,IORING_OFF_CQ_RING);
+  r->sqes = (struct io_uring_sqe *) uring_map (fd,r->sqes_len,IORING_OFF_SQES);
+  if (!r->sq_ptr || !r->cq_ptr || !r->sqes) {
+    uring_destroy (r);
+    return NULL;
+  }
+
+  r->sq_head = (unsigned *) ((char *) r->sq_ptr + p.sq_off.head);
+  r->sq_tail = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+  r->sq_mask = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+  r->cq_head = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+  r->cq_mask = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+  return r;
+}
+
+/* submit queued entries and wait for `wait' completions. returns the number
+ * submitted or -errno. */
+
+static int uring_enter (TransportRing *r, unsigned wait)
+{
+  int n = (int) syscall (__NR_io_uring_enter,r->fd,r->queued,wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+  if (n < 0) return -errno;
+  r->queued -= n;
+  return n;
+}
+
+/* next free submission entry, cleared. the kernel only looks at entries
+ * during io_uring_enter, so they may be filled in after the tail moved. NULL
+ * if the queue is full. */
+
+static struct io_uring_sqe *uring_get_sqe (TransportRing *r)
+{
+  unsigned tail = *r->sq_tail;
+  unsigned index;
+
+  if (tail - __atomic_load_n (r->sq_head,__ATOMIC_ACQUIRE) >= r->entries)
+    return NULL;
+  index = tail & *r->sq_mask;
+  memset (&r->sqes[ index ],0,sizeof (struct io_uring_sqe));
+  r->sq_array[ index ] = index;
+  __atomic_store_n (r->sq_tail,tail + 1,__ATOMIC_RELEASE);
+  r->queued++;
+  return &r->sqes[ index ];
+}
+
+/* take the next completion, 0 if there is none */
+
+static int uring_reap (TransportRing *r, struct io_uring_cqe *cqe)
+{
+  unsigned head = *r->cq_head;
+
+  if (head == __atomic_load_n (r->cq_tail,__ATOMIC_ACQUIRE))
+    return 0;
+  *cqe = r->cqes[ head & *r->cq_mask ];
+  __atomic_store_n (r->cq_head,head + 1,__ATOMIC_RELEASE);
+  return 1;
+}
+
+/* client requests: submit everything queued and wait until all of it has
+ * completed, so nothing in flight refers to the caller's memory afterwards.
+ * results are stored by user_data (0 or 1). returns -1 without side effects
+ * if the kernel took none of the requests. */
+
+static int uring_run (TransportRing *r, int *res)
+{
+  struct io_uring_cqe cqe;
+  int want = r->queued, done = 0, n;
+
+  while (done < want) {
+    n = uring_enter (r,want - done);
+    if (n < 0 && r->queued == (unsigned) want) {
+      if (n == -EINTR) continue;
+      *r->sq_tail -= r->queued;
+      r->queued = 0;
+      return -1;
+    }
+    while (uring_reap (r,&cqe)) {
+      if (cqe.user_data < 2) res[ cqe.user_data ] = cqe.res;
+      done++;
+    }
+  }
+  return 0;
+}
+
+/* the ring used by client calls, set up on first use. a process created by
+ * fork must not share its parent's ring, so it gets its own. */
+
+static TransportRing *uring_client (void)
+{
+  static TransportRing *ring = NULL;
+  static pid_t owner = 0;
+
+  if (owner != getpid ()) {
+    /* linked requests only fail together with short sends on kernels that
+     * have native io workers (5.12) */
+    owner = getpid ();
+    ring = uring_create (4,IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL |
+                           IORING_FEAT_NATIVE_WORKERS);
+  }
+  return ring;
+}
+
+/* send the request, then receive into buffer: both are posted with a single
+ * system call, the receive linked behind the send. a short send cancels the
+ * receive and the rest goes out with plain calls. large requests aren't
+ * worth it and are sent the plain way. */
+
+int transport_write_read (Transport *tpt, const TransportVec *vec, int count, u8 *buffer, int length)
+{
+  struct exception e;
+  struct iovec iov[ TRANSPORT_WQ_LEN ];
+  struct msghdr msg;
+  struct io_uring_sqe *sqe;
+  TransportRing *r = NULL;
+  TransportVec rest[ TRANSPORT_WQ_LEN ];
+  int res[ 2 ];
+  int i, total = 0, sent;
+  TRANSPORT_VERIFY_OPEN;
+
+  for (i = 0; i < count; i++) {
+    iov[ i ].iov_base = (void *) vec[ i ].base;
+    iov[ i ].iov_len = vec[ i ].len;
+    total += vec[ i ].len;
+  }
+
+  if (total <= TRANSPORT_WBUF_SIZE)
+    r = uring_client ();
+  if (r == NULL) {
+    transport_write_vector (tpt,vec,count);
+    return transport_read_buffer (tpt,buffer,length);
+  }
+
+  memset (&msg,0,sizeof (msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+
+  sqe = uring_get_sqe (r);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = tpt->fd;
+  sqe->addr = (__u64) (uintptr_t) &msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = 0;
+
+  sqe = uring_get_sqe (r);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = tpt->fd;
+  sqe->addr = (__u64) (uintptr_t) buffer;
+  sqe->len = length;
+  sqe->user_data = 1;
+
+  if (uring_run (r,res) < 0) {
+    transport_write_vector (tpt,vec,count);
+    return transport_read_buffer (tpt,buffer,length);
+  }
+
+  sent = res[ 0 ];
+  if (sent < 0) {
+    e.errnum = -sent;
+    e.type = fatal;
+    Throw( e );
+  }
+  if (sent < total) {
+    for (i = 0; sent >= (int) vec[ i ].len; i++)
+      sent -= vec[ i ].len;
+    memcpy (rest,vec + i,(count - i) * sizeof (TransportVec));
+    rest[ 0 ].base += sent;
+    rest[ 0 ].len -= sent;
+    transport_write_vector (tpt,rest,count - i);
+  }
+
+  if (res[ 1 ] == -ECANCELED)
+    return transport_read_buffer (tpt,buffer,length);
+  if (res[ 1 ] == 0) {
+    e.errnum = ERR_EOF;
+    e.type = nonfatal;
+    Throw( e );
+  }
+  if (res[ 1 ] < 0) {
+    e.errnum = -res[ 1 ];
+    e.type = fatal;
+    Throw( e );
+  }
+  return res[ 1 ];
+}
+
+/* connect with a timeout linked to it. returns 0 or an errno value, -1 if
+ * the ring can't be used. */
+
+static int uring_connect (int fd, struct sockaddr *addr, socklen_t len, double timeout)
+{
+  struct __kernel_timespec ts;
+  struct io_uring_sqe *sqe;
+  TransportRing *r = uring_client ();
+  int res[ 2 ];
+
+  if (r == NULL) return -1;
+
+  ts.tv_sec = (long long) timeout;
+  ts.tv_nsec = (long long) ((timeout - (double) ts.tv_sec) * 1e9);
+
+  sqe = uring_get_sqe (r);
+  sqe->opcode = IORING_OP_CONNECT;
+  sqe->fd = fd;
+  sqe->addr = (__u64) (uintptr_t) addr;
+  sqe->off = len;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = 0;
+
+  sqe = uring_get_sqe (r);
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (__u64) (uintptr_t) &ts;
+  sqe->len = 1;
+  sqe->user_data = 1;
+
+  if (uring_run (r,res) < 0) return -1;
+  if (res[ 0 ] == -ECANCELED) return ETIMEDOUT;
+  return -res[ 0 ];
+}
+
+#endif /* LUARPC_ENABLE_IO_URING */
+
+#ifndef WIN32
+
+/* connect the socket to an address, giving up after timeout seconds */
+
+static void transport_connect_timeout (Transport *tpt, struct sockaddr *addr, socklen_t addr_len, double timeout)
+{
+  struct exception e;
+  struct timeval tv;
+  fd_set set;
+  socklen_t len;
+  int flags, n, err = -1;
   TRANSPORT_VERIFY_OPEN;
-  n = write (tpt->fd,buffer,length);
-  if (n != length) 
+
+#ifdef LUARPC_ENABLE_IO_URING
+  err = uring_connect (tpt->fd,addr,addr_len,timeout);
+#endif
+  if (err < 0) {
+    /* non-blocking connect, wait for it to become writable */
+    flags = fcntl (tpt->fd,F_GETFL,0);
+    fcntl (tpt->fd,F_SETFL,flags | O_NONBLOCK);
+    err = 0;
+    if (connect (tpt->fd,addr,addr_len) != 0) {
+      err = sock_errno;
+      if (err == EINPROGRESS) {
+        FD_ZERO (&set);
+        FD_SET (tpt->fd,&set);
+        tv.tv_sec = (long) timeout;
+        tv.tv_usec = (long) ((timeout - (double) tv.tv_sec) * 1e6);
+        n = select (tpt->fd + 1,0,&set,0,&tv);
+        if (n == 0)
+          err = ETIMEDOUT;
+        else if (n < 0)
+          err = sock_errno;
+        else {
+          len = sizeof (err);
+          if (getsockopt (tpt->fd,SOL_SOCKET,SO_ERROR,(char *) &err,&len) != 0)
+            err = sock_errno;
+        }
+      }
+    }
+    fcntl (tpt->fd,F_SETFL,flags);
+  }
+
+  if (err != 0)
   {
-    e.errnum = sock_errno;
+    e.errnum = err;
     e.type = fatal;
     Throw( e );
   }
 }
 
+#endif
+
+/* open a connection. arguments are the host and port number, or a
+ * "unix:/path", and an optional table of options:
+ *    timeout = s    give up connecting after s seconds
+ */
+
 int transport_open_connection(lua_State *L, Handle *handle)
 {
-  int ip_port;
+  int ip_port, nargs;
   u32 ip_address;
+  lua_Number timeout;
   struct hostent *host;
+#ifndef WIN32
+  struct sockaddr_un addr;
+  struct sockaddr_in myname;
+#endif
+
+  nargs = lua_gettop (L); /* Last arg is handle.. */
+
+#ifndef WIN32
+  /* rpc.connect ("unix:/path" [, options]) */
+  if (get_unix_address (L,1,&addr)) {
+    if (nargs != 2 && nargs != 3)
+      luaL_error (L,"must have 1 or 2 args");
+    timeout = get_option_number (L,(nargs == 3) ? 2 : 0,"timeout",0);
+    transport_open_unix (&handle->tpt);
+    if (timeout > 0)
+      transport_connect_timeout (&handle->tpt,(struct sockaddr *) &addr,sizeof (addr),timeout);
+    else
+      transport_connect_unix (&handle->tpt,&addr);
+    return 1;
+  }
+#endif
 
-  check_num_args (L,3); /* Last arg is handle.. */
+  if (nargs != 3 && nargs != 4)
+    luaL_error (L,"must have 2 or 3 args");
   if (!lua_isstring (L,1))
     my_lua_error (L,"first argument must be an ip address string");
   ip_port = get_port_number (L,2);
+  timeout = get_option_number (L,(nargs == 4) ? 3 : 0,"timeout",0);
 
   host = gethostbyname (lua_tostring (L,1));
   if (!host) {
@@ -362,22 +1050,563 @@ int transport_open_connection(lua_State *L, Handle *handle)
   transport_open (&handle->tpt);
 
   /* connect the transport to the target server */
+#ifndef WIN32
+  if (timeout > 0) {
+    memset (&myname,0,sizeof (myname));
+    myname.sin_family = AF_INET;
+    myname.sin_port = htons ((u16) ip_port);
+    myname.sin_addr.s_addr = htonl (ip_address);
+    transport_connect_timeout (&handle->tpt,(struct sockaddr *) &myname,sizeof (myname),timeout);
+  }
+  else
+#endif
   transport_connect (&handle->tpt,ip_address,(u16) ip_port);
 
   return 1;
 }
 
 
+/****************************************************************************/
+/* event driven server. the listening socket and all accepted connections are
+ * watched by one epoll instance, connections are handed to server.c when
+ * they have data to read.
+ */
+
+#ifdef LUARPC_ENABLE_EPOLL
+
+/* out of descriptors the connection stays queued on the listener, which
+ * would report it again right away. the listener is left alone until a
+ * connection is removed, or a wait has slept ACCEPT_RETRY ms, and the
+ * queued ones are accepted then. */
+
+static int accept_exhausted (int err)
+{
+  return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+}
+
+static void transport_pause_accept (ServerHandle *handle)
+{
+  struct epoll_event ev;
+
+  handle->accept_paused = 1;
+#ifdef LUARPC_ENABLE_IO_URING
+  if (handle->ring) return; /* no accept is posted while paused */
+#endif
+  ev.events = 0;
+  ev.data.ptr = NULL;
+  epoll_ctl (handle->epfd,EPOLL_CTL_MOD,handle->ltpt.fd,&ev);
+}
+
+void transport_resume_accept (ServerHandle *handle)
+{
+  struct epoll_event ev;
+
+  if (!handle->accept_paused) return;
+  handle->accept_paused = 0;
+  if (handle->epfd < 0 || !transport_is_open (&handle->ltpt)) return;
+#ifdef LUARPC_ENABLE_IO_URING
+  if (handle->ring) return; /* the next wait posts the accept */
+#endif
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl (handle->epfd,EPOLL_CTL_MOD,handle->ltpt.fd,&ev);
+}
+
+#ifdef LUARPC_ENABLE_IO_URING
+
+/* completion driven server. the listener has an accept in flight and every
+ * idle connection a receive into its read-ahead buffer, so a request is in
+ * memory by the time its connection is handed out. connections handed out
+ * by one wait get their receive posted by the next one, all new requests go
+ * to the kernel with the system call that waits. */
+
+static struct io_uring_sqe *uring_server_sqe (TransportRing *r)
+{
+  struct exception e;
+  struct io_uring_sqe *sqe;
+  int n;
+
+  while ((sqe = uring_get_sqe (r)) == NULL) {
+    n = uring_enter (r,0);
+    if (n < 0 && n != -EINTR && n != -EAGAIN && n != -EBUSY)
+    {
+      e.errnum = -n;
+      e.type = fatal;
+      Throw( e );
+    }
+  }
+  return sqe;
+}
+
+static void uring_accept (ServerHandle *handle)
+{
+  struct io_uring_sqe *sqe = uring_server_sqe (handle->ring);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = handle->ltpt.fd;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = URING_LISTENER;
+  handle->ring->accepting = 1;
+}
+
+static void uring_recv (ServerHandle *handle, ServerConn *conn)
+{
+  struct io_uring_sqe *sqe = uring_server_sqe (handle->ring);
+
+  /* a lua error can leave gathered bytes of a command in use */
+  transport_gather_end (&conn->tpt);
+  conn->tpt.rbuf_pos = 0;
+  conn->tpt.rbuf_len = 0;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->tpt.fd;
+  sqe->addr = (__u64) (uintptr_t) conn->tpt.rbuf;
+  sqe->len = TRANSPORT_RBUF_SIZE;
+  sqe->user_data = (__u64) (uintptr_t) conn;
+  conn->uring_state = URING_RECEIVING;
+}
+
+static void uring_push_ready (TransportRing *r, ServerConn *conn)
+{
+  conn->uring_state = URING_READY;
+  conn->uring_next = NULL;
+  if (r->ready_tail)
+    r->ready_tail->uring_next = conn;
+  else
+    r->ready = conn;
+  r->ready_tail = conn;
+}
+
+/* handle all completions. a failed receive is handed out like a good one,
+ * reading from the connection then reports the error. */
+
+static void uring_complete (ServerHandle *handle)
+{
+  TransportRing *r = handle->ring;
+  struct io_uring_cqe cqe;
+  ServerConn *conn;
+
+  while (uring_reap (r,&cqe)) {
+    if (cqe.user_data == URING_IGNORE)
+      continue;
+
+    if (cqe.user_data == URING_LISTENER) {
+      r->accepting = 0;
+      if (cqe.res < 0) {
+        if (accept_exhausted (-cqe.res))
+          transport_pause_accept (handle);
+        continue;
+      }
+      if (!transport_is_open (&handle->ltpt) ||
+          (conn = server_conn_add (handle)) == NULL) {
+        close (cqe.res);
+        continue;
+      }
+      conn->tpt.fd = cqe.res;
+      uring_recv (handle,conn);
+      continue;
+    }
+
+    conn = (ServerConn *) (uintptr_t) cqe.user_data;
+    conn->tpt.rbuf_len = (cqe.res > 0) ? cqe.res : 0;
+    uring_push_ready (r,conn);
+  }
+}
+
+static int uring_wait_events (ServerHandle *handle, ServerConn **ready, int max, int timeout)
+{
+  TransportRing *r = handle->ring;
+  struct __kernel_timespec ts;
+  struct io_uring_sqe *sqe;
+  ServerConn *conn;
+  int n, retry;
+
+  /* connections served since the last wait go back to receiving, unless
+   * they still hold data (nobody took them after a peek) */
+  while ((conn = r->idle) != NULL) {
+    r->idle = conn->uring_next;
+    if (transport_buffered (&conn->tpt) > 0)
+      uring_push_ready (r,conn);
+    else
+      uring_recv (handle,conn);
+  }
+  if (!r->accepting && !handle->accept_paused &&
+      transport_is_open (&handle->ltpt))
+    uring_accept (handle);
+
+  retry = handle->accept_paused && (timeout < 0 || timeout > ACCEPT_RETRY);
+  if (retry)
+    timeout = ACCEPT_RETRY;
+  if (r->ready == NULL && timeout > 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    sqe = uring_server_sqe (r);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (__u64) (uintptr_t) &ts;
+    sqe->len = 1;
+    sqe->user_data = URING_IGNORE;
+  }
+
+  n = uring_enter (r,(r->ready == NULL && timeout != 0) ? 1 : 0);
+  if (n < 0 && n != -EINTR && n != -EAGAIN && n != -EBUSY)
+  {
+    struct exception e;
+    e.errnum = -n;
+    e.type = fatal;
+    Throw( e );
+  }
+  uring_complete (handle);
+
+  /* receives for connections accepted just now go in as well, otherwise a
+   * caller that polls the ring (rpc.wait) sleeps through their data. a
+   * failure shows on the next wait. */
+  if (r->queued > 0)
+    uring_enter (r,0);
+  if (retry && r->ready == NULL)
+    transport_resume_accept (handle);
+
+  for (n = 0; n < max && (conn = r->ready) != NULL; n++) {
+    r->ready = conn->uring_next;
+    if (r->ready == NULL)
+      r->ready_tail = NULL;
+    conn->uring_state = URING_IDLE;
+    conn->uring_next = r->idle;
+    r->idle = conn;
+    ready[ n ] = conn;
+  }
+  return n;
+}
+
+static void uring_unlink (ServerConn **list, ServerConn *conn)
+{
+  for (; *list; list = &(*list)->uring_next)
+    if (*list == conn) {
+      *list = conn->uring_next;
+      return;
+    }
+}
+
+/* a receive in flight writes into the connection, so it must be cancelled
+ * and completed before the connection can be freed */
+
+static void uring_drop (ServerHandle *handle, ServerConn *conn)
+{
+  TransportRing *r = handle->ring;
+  struct io_uring_sqe *sqe;
+  ServerConn *last;
+
+  if (conn->uring_state == URING_RECEIVING) {
+    sqe = uring_server_sqe (r);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (__u64) (uintptr_t) conn;
+    sqe->user_data = URING_IGNORE;
+    while (conn->uring_state == URING_RECEIVING) {
+      uring_enter (r,1);
+      uring_complete (handle);
+    }
+  }
+
+  if (conn->uring_state == URING_READY) {
+    uring_unlink (&r->ready,conn);
+    for (last = r->ready; last && last->uring_next; last = last->uring_next);
+    r->ready_tail = last;
+  }
+  else
+    uring_unlink (&r->idle,conn);
+  conn->uring_state = URING_IDLE;
+}
+
+/* use io_uring for a server if the kernel can, returns 0 to fall back */
+
+static int uring_open_events (ServerHandle *handle)
+{
+  handle->ring = uring_create (URING_ENTRIES,IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL);
+  if (handle->ring == NULL)
+    return 0;
+  handle->epfd = handle->ring->fd;
+  uring_accept (handle);
+  return 1;
+}
+
+#endif /* LUARPC_ENABLE_IO_URING */
+
+static void transport_open_events (ServerHandle *handle)
+{
+  struct exception e;
+  struct epoll_event ev;
+  int flags;
+
+#ifdef LUARPC_ENABLE_IO_URING
+  if (uring_open_events (handle))
+    return;
+#endif
+
+  handle->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (handle->epfd < 0)
+  {
+    e.errnum = sock_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+
+  /* connections are accepted in batches until none is left, so the
+   * listening socket must not block */
+  flags = fcntl (handle->ltpt.fd,F_GETFL,0);
+  fcntl (handle->ltpt.fd,F_SETFL,flags | O_NONBLOCK);
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL; /* NULL marks the listener */
+  if (epoll_ctl (handle->epfd,EPOLL_CTL_ADD,handle->ltpt.fd,&ev) != 0)
+  {
+    e.errnum = sock_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+}
+
+void transport_close_events (ServerHandle *handle)
+{
+#ifdef LUARPC_ENABLE_IO_URING
+  /* closing the ring cancels the accept */
+  if (handle->ring) {
+    uring_destroy (handle->ring);
+    handle->ring = NULL;
+    handle->epfd = -1;
+  }
+#endif
+  if (handle->epfd >= 0) close (handle->epfd);
+  handle->epfd = -1;
+}
+
+/* closing a socket takes it out of the epoll set, nothing to do for epoll */
+
+void transport_drop_events (ServerHandle *handle, ServerConn *conn)
+{
+#ifdef LUARPC_ENABLE_IO_URING
+  if (handle->ring)
+    uring_drop (handle,conn);
+#endif
+}
+
+/* accept pending connections. other failures are not fatal for the server,
+ * the connection stays in the queue and is retried on the next event. */
+
+static void transport_accept_batch (ServerHandle *handle)
+{
+  struct epoll_event ev;
+  ServerConn *conn;
+  int i, fd;
+
+  for (i = 0; i < ACCEPT_BATCH; i++) {
+    fd = accept4 (handle->ltpt.fd,NULL,NULL,SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (accept_exhausted (sock_errno))
+        transport_pause_accept (handle);
+      return;
+    }
+
+    conn = server_conn_add (handle);
+    if (conn == NULL) {
+      close (fd);
+      return;
+    }
+    conn->tpt.fd = fd;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    /* no session yet, so no lua state is needed to release it */
+    if (epoll_ctl (handle->epfd,EPOLL_CTL_ADD,fd,&ev) != 0)
+      server_conn_remove (NULL,handle,conn);
+  }
+}
+
+int transport_wait_events (ServerHandle *handle, ServerConn **ready, int max, int timeout)
+{
+  struct exception e;
+  struct epoll_event ev[ MAX_EVENTS ];
+  int i, n, retry, nready = 0;
+
+#ifdef LUARPC_ENABLE_IO_URING
+  if (handle->ring)
+    return uring_wait_events (handle,ready,max,timeout);
+#endif
+
+  retry = handle->accept_paused && (timeout < 0 || timeout > ACCEPT_RETRY);
+  if (retry)
+    timeout = ACCEPT_RETRY;
+  if (max > MAX_EVENTS) max = MAX_EVENTS;
+  n = epoll_wait (handle->epfd,ev,max,timeout);
+  if (n < 0)
+  {
+    if (sock_errno == EINTR) return 0;
+    e.errnum = sock_errno;
+    e.type = fatal;
+    Throw( e );
+  }
+
+  if (n == 0 && retry)
+    transport_resume_accept (handle);
+  for (i = 0; i < n; i++) {
+    if (ev[ i ].data.ptr == NULL)
+      transport_accept_batch (handle);
+    else
+      ready[ nready++ ] = (ServerConn *) ev[ i ].data.ptr;
+  }
+  return nready;
+}
+
+#endif /* LUARPC_ENABLE_EPOLL */
+
+/* open a listening socket. arguments are the port number and an optional
+ * table of options:
+ *    backlog = n    length of the queue of pending connections
+ */
+
 void transport_open_listener(lua_State *L, ServerHandle *handle)
 {
-  int port;
+  int port, backlog, reuseport, opts;
+  int nargs = lua_gettop (L); /* last arg is server handle */
+#ifndef WIN32
+  struct sockaddr_un addr;
+#endif
+
+  if (nargs != 2 && nargs != 3)
+    luaL_error (L,"must have 1 or 2 args");
+  opts = (nargs == 3) ? 2 : 0;
+  backlog = (int) get_option_number (L,opts,"backlog",MAXCON);
+  reuseport = get_option_boolean (L,opts,"reuseport",0);
+
+#ifndef WIN32
+  /* rpc.listen ("unix:/path") */
+  if (get_unix_address (L,1,&addr)) {
+    if (reuseport)
+      my_lua_error (L,"reuseport needs a tcp port");
+    transport_open_unix (&handle->ltpt);
+    transport_bind_unix (&handle->ltpt,&addr);
+  }
+  else
+#endif
+  {
+    port = get_port_number (L,1);
+    transport_open (&handle->ltpt);
+    if (reuseport)
+      transport_reuseport (&handle->ltpt);
+    transport_bind (&handle->ltpt,INADDR_ANY,(u16) port);
+  }
+  transport_listen (&handle->ltpt,backlog);
+#ifdef LUARPC_ENABLE_EPOLL
+  transport_open_events (handle);
+#endif
+}
 
-  check_num_args (L,2); /* 2nd arg is server handle */
-  port = get_port_number (L,1);
+/* ask event driven servers for connections with a command to dispatch. new
+ * connections are accepted on the way, so a server that only had one to
+ * accept isn't ready. */
 
-  transport_open (&handle->ltpt);
-  transport_bind (&handle->ltpt,INADDR_ANY,(u16) port);
-  transport_listen (&handle->ltpt,MAXCON);
+#ifdef LUARPC_ENABLE_EPOLL
+static int transport_poll_servers (TransportPoll *p, int count)
+{
+  ServerConn *ready[ MAX_EVENTS ];
+  int i, n = 0;
+
+  for (i = 0; i < count; i++)
+    if (p[ i ].server && transport_is_open (&p[ i ].server->ltpt) &&
+        transport_wait_events (p[ i ].server,ready,MAX_EVENTS,0) > 0) {
+      p[ i ].ready = 1;
+      n++;
+    }
+  return n;
+}
+#endif
+
+/* wait for any of several sockets or servers with poll, which has no limit
+ * on descriptor numbers like select. event driven servers are watched
+ * through their epoll (or io_uring) descriptor. */
+
+int transport_poll (TransportPoll *p, int count, int timeout)
+{
+  struct exception e;
+  struct pollfd *fds = alloca (count * sizeof (struct pollfd) + 1);
+  struct timespec start, now;
+  int i, n, r, ms, paused = 0, left = timeout;
+
+  clock_gettime (CLOCK_MONOTONIC,&start);
+  for (;;) {
+    n = 0;
+    for (i = 0; i < count; i++) {
+      Transport *tpt = p[ i ].tpt;
+
+      p[ i ].ready = 0;
+      fds[ i ].fd = -1; /* ignored by poll */
+      fds[ i ].events = POLLIN;
+      fds[ i ].revents = 0;
+#ifdef LUARPC_ENABLE_EPOLL
+      if (p[ i ].server) {
+        if (transport_is_open (&p[ i ].server->ltpt))
+          fds[ i ].fd = p[ i ].server->epfd;
+        continue;
+      }
+#endif
+      if (transport_is_open (tpt)) {
+        fds[ i ].fd = tpt->fd;
+        if (transport_buffered (tpt) > 0) {
+          p[ i ].ready = 1;
+          n++;
+        }
+      }
+    }
+#ifdef LUARPC_ENABLE_EPOLL
+    n += transport_poll_servers (p,count);
+#endif
+
+    /* still look at the others if something is ready already */
+    ms = n > 0 ? 0 : left;
+#ifdef LUARPC_ENABLE_EPOLL
+    /* a server out of descriptors doesn't wake up for new connections, it
+     * accepts again once the poll has slept ACCEPT_RETRY ms */
+    for (i = 0, paused = 0; i < count; i++)
+      if (p[ i ].server && p[ i ].server->accept_paused)
+        paused = 1;
+    if (paused && (ms < 0 || ms > ACCEPT_RETRY))
+      ms = ACCEPT_RETRY;
+    else
+      paused = 0;
+#endif
+    r = poll (fds,count,ms);
+    if (r < 0 && sock_errno != EINTR)
+    {
+      e.errnum = sock_errno;
+      e.type = fatal;
+      Throw( e );
+    }
+#ifdef LUARPC_ENABLE_EPOLL
+    if (r == 0 && paused)
+      for (i = 0; i < count; i++)
+        if (p[ i ].server)
+          transport_resume_accept (p[ i ].server);
+#endif
+
+    for (i = 0; i < count; i++) {
+      if (fds[ i ].revents == 0 || p[ i ].ready)
+        continue;
+#ifdef LUARPC_ENABLE_EPOLL
+      if (p[ i ].server) /* asked again on the next round */
+        continue;
+#endif
+      p[ i ].ready = 1;
+      n++;
+    }
+    if (n > 0 || left == 0)
+      return n;
+
+    /* a server woke up or a signal came in, go again with what's left */
+    if (left > 0) {
+      clock_gettime (CLOCK_MONOTONIC,&now);
+      left = timeout - (int) ((now.tv_sec - start.tv_sec) * 1000 +
+                              (now.tv_nsec - start.tv_nsec) / 1000000);
+      if (left < 0)
+        left = 0;
+    }
+  }
 }
 
 /* see if there is any data to read from a socket, without actually reading
@@ -394,6 +1623,9 @@ int transport_readable (Transport *tpt)
   if (tpt->fd == INVALID_TRANSPORT)
     return 0;
 
+  if (transport_buffered (tpt) > 0)
+    return 1;
+
   FD_ZERO (&set);
   FD_SET (tpt->fd,&set);
 
@@ -0,0 +1,145 @@
+// LZF compression
+
+#include <string.h>
+
+#include "type.h"
+#include "lzf.h"
+
+#define LZF_HSIZE ( 1 << LZF_HLOG )
+#define LZF_MAX_LIT ( 1 << 5 )                  // longest literal run
+#define LZF_MAX_OFF ( 1 << 13 )                 // farthest back reference
+#define LZF_MAX_REF ( ( 1 << 8 ) + ( 1 << 3 ) ) // longest back reference
+
+// positions of recent 3 byte sequences, plus 1 so that 0 is empty
+static u32 lzf_htab[ LZF_HSIZE ];
+
+#define LZF_HASH( p ) \
+  ( ( ( ( u32 )( p )[ 0 ] << 16 | ( u32 )( p )[ 1 ] << 8 | ( p )[ 2 ] ) * 2654435761u ) >> ( 32 - LZF_HLOG ) )
+
+unsigned int lzf_compress( const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len )
+{
+  const u8 *in = ( const u8 * )in_data;
+  const u8 *ip = in, *in_end = in + in_len;
+  u8 *out = ( u8 * )out_data;
+  u8 *op = out, *out_end = out + out_len;
+  unsigned int lit = 0;
+
+  if( in_len == 0 || out_len < 2 )
+    return 0;
+  memset( lzf_htab, 0, sizeof( lzf_htab ) );
+
+  // each literal run starts with a control byte, keep room for it
+  op ++;
+
+  while( ip < in_end )
+  {
+    if( ip + 2 < in_end )
+    {
+      u32 h = LZF_HASH( ip );
+      u32 pos = lzf_htab[ h ];
+      u32 off = ip - in - pos;
+
+      lzf_htab[ h ] = ip - in + 1;
+      if( pos != 0 && off < LZF_MAX_OFF &&
+          in[ pos - 1 ] == ip[ 0 ] && in[ pos ] == ip[ 1 ] && in[ pos + 1 ] == ip[ 2 ] )
+      {
+        const u8 *ref = in + pos - 1;
+        u32 max = in_end - ip, len = 3;
+
+        if( max > LZF_MAX_REF )
+          max = LZF_MAX_REF;
+        while( len < max && ref[ len ] == ip[ len ] )
+          len ++;
+
+        // back reference, at most 3 bytes plus the next control byte
+        if( op + 3 >= out_end )
+          return 0;
+        if( lit != 0 )
+          op[ - ( int )lit - 1 ] = lit - 1;
+        else
+          op --;
+        lit = 0;
+
+        ip += len;
+        len -= 2;
+        if( len < 7 )
+          *op ++ = ( u8 )( ( off >> 8 ) + ( len << 5 ) );
+        else
+        {
+          *op ++ = ( u8 )( ( off >> 8 ) + ( 7 << 5 ) );
+          *op ++ = ( u8 )( len - 7 );
+        }
+        *op ++ = ( u8 )off;
+        op ++;
+
+        // let the last positions of the match be found again
+        if( ip + 2 < in_end )
+          lzf_htab[ LZF_HASH( ip - 1 ) ] = ip - in;
+        continue;
+      }
+    }
+
+    if( op >= out_end )
+      return 0;
+    *op ++ = *ip ++;
+    if( ++ lit == LZF_MAX_LIT )
+    {
+      op[ - ( int )lit - 1 ] = lit - 1;
+      lit = 0;
+      op ++;
+    }
+  }
+
+  if( lit != 0 )
+    op[ - ( int )lit - 1 ] = lit - 1;
+  else
+    op --;
+  return op > out_end ? 0 : op - out;
+}
+
+unsigned int lzf_decompress( const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len )
+{
+  const u8 *ip = ( const u8 * )in_data, *in_end = ip + in_len;
+  u8 *out = ( u8 * )out_data;
+  u8 *op = out, *out_end = out + out_len;
+
+  while( ip < in_end )
+  {
+    u32 ctrl = *ip ++;
+
+    if( ctrl < LZF_MAX_LIT )
+    {
+      // literal run
+      ctrl ++;
+      if( ctrl > ( u32 )( out_end - op ) || ctrl > ( u32 )( in_end - ip ) )
+        return 0;
+      memcpy( op, ip, ctrl );
+      op += ctrl;
+      ip += ctrl;
+    }
+    else
+    {
+      // back reference, may overlap what it produces
+      u32 len = ctrl >> 5, off = ( ctrl & 0x1f ) << 8;
+      const u8 *ref;
+
+      if( len == 7 )
+      {
+        if( ip >= in_end )
+          return 0;
+        len += *ip ++;
+      }
+      if( ip >= in_end )
+        return 0;
+      off += *ip ++ + 1;
+      len += 2;
+      if( off > ( u32 )( op - out ) || len > ( u32 )( out_end - op ) )
+        return 0;
+      ref = op - off;
+      do
+        *op ++ = *ref ++;
+      while( -- len );
+    }
+  }
+  return op - out;
+}
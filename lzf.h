@@ -0,0 +1,22 @@
+// LZF compression
+//   a small, fast LZ77 codec in the LZF stream format: no header, a control
+//   byte starts either a run of 1 to 32 literal bytes or a back reference of
+//   3 to 264 bytes at most 8 KB back. used to compress large values on slow
+//   links.
+
+#ifndef __LZF_H__
+#define __LZF_H__
+
+#ifndef LZF_HLOG
+#define LZF_HLOG ( 13 ) // log2 of the match finder's hash table entries
+#endif
+
+// compress in_len bytes into out, returns the compressed length or 0 if it
+// doesn't fit in out_len bytes
+unsigned int lzf_compress( const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len );
+
+// decompress in_len bytes into out, returns the decompressed length or 0 if
+// the data is corrupt or doesn't fit in out_len bytes
+unsigned int lzf_decompress( const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len );
+
+#endif
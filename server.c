@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 #ifdef __MINGW32__
 void *alloca(size_t);
 #else
@@ -109,7 +110,8 @@ enum
   RPC_CMD_CALL = 1,
   RPC_CMD_GET,
   RPC_CMD_CON,
-  RPC_CMD_NEWINDEX
+  RPC_CMD_NEWINDEX,
+  RPC_CMD_CALL_ID
 };
 
 // RPC Status Codes
@@ -120,7 +122,7 @@ enum
   RPC_DONE
 };
 
-enum { RPC_PROTOCOL_VERSION = 3 };
+enum { RPC_PROTOCOL_VERSION = 4 };
 
 
 // return a string representation of an error number 
@@ -153,55 +155,249 @@ ServerHandle *server_handle_create( lua_State *L )
 
   transport_init( &h->ltpt );
   transport_init( &h->atpt );
+#ifdef LUARPC_ENABLE_EPOLL
+  h->epfd = -1;
+  h->conns = NULL;
+  h->dispatching = 0;
+  h->accept_paused = 0;
+#endif
+#ifdef LUARPC_ENABLE_IO_URING
+  h->ring = NULL;
+#endif
   return h;
 }
 
-void server_handle_shutdown( ServerHandle *h )
+void server_handle_shutdown( lua_State *L, ServerHandle *h )
+{
+  transport_close( &h->ltpt, L );
+  transport_close( &h->atpt, L );
+#ifdef LUARPC_ENABLE_EPOLL
+  // a called function shutting the server down only closes the connections,
+  // the event loop still refers to them and frees them when it is done
+  if( h->dispatching )
+  {
+    ServerConn *c;
+    for( c = h->conns; c; c = c->next )
+    {
+      transport_drop_events( h, c );
+      transport_close( &c->tpt, L );
+    }
+  }
+  else
+    while( h->conns )
+      server_conn_remove( L, h, h->conns );
+  transport_close_events( h );
+#endif
+}
+
+void server_handle_destroy( lua_State *L, ServerHandle *h )
+{
+#ifdef LUARPC_ENABLE_EPOLL
+  h->dispatching = 0;
+#endif
+  server_handle_shutdown( L, h );
+}
+
+#ifdef LUARPC_ENABLE_EPOLL
+// add a connection to a server handle, the transport fills in the link
+ServerConn *server_conn_add( ServerHandle *h )
 {
-  transport_close( &h->ltpt );
-  transport_close( &h->atpt );
+  ServerConn *c = ( ServerConn * )malloc( sizeof( ServerConn ) );
+  if( c == NULL )
+    return NULL;
+
+  transport_init( &c->tpt );
+  c->link_errs = 0;
+  c->negotiated = 0;
+  transport_scan_init( &c->scan );
+  c->pend = NULL;
+  c->pend_len = 0;
+  c->pend_size = 0;
+  c->pend_run = 0;
+#ifdef LUARPC_ENABLE_FILE
+  c->spool = NULL;
+#endif
+#ifdef LUARPC_ENABLE_IO_URING
+  c->uring_state = 0;
+  c->uring_next = NULL;
+#endif
+  c->prev = NULL;
+  c->next = h->conns;
+  if( h->conns )
+    h->conns->prev = c;
+  h->conns = c;
+  return c;
 }
 
-void server_handle_destroy( ServerHandle *h )
+// close a connection and drop it from its server handle
+void server_conn_remove( lua_State *L, ServerHandle *h, ServerConn *c )
 {
-  server_handle_shutdown( h );
+  transport_drop_events( h, c );
+  transport_close( &c->tpt, L );
+  transport_scan_free( &c->scan );
+  free( c->pend );
+  if( c->prev )
+    c->prev->next = c->next;
+  else
+    h->conns = c->next;
+  if( c->next )
+    c->next->prev = c->prev;
+  free( c );
+  transport_resume_accept( h );
 }
+#endif
 
 
 
 //****************************************************************************
-// lua remote function server
-//   read function call data and execute the function. this function empties the
-//   stack on entry and exit. This sets a custom error handler to catch errors 
-//   around the function call.
-
-static void read_cmd_call( Transport *tpt, lua_State *L )
+// numbered function paths
+//   with the path id option a function called by name is given a number the
+//   first time, which the client sends from then on. the server keeps the
+//   keys of each numbered path, split and interned, and looks the function
+//   up again on every call, so functions replaced on the server are seen.
+
+// read a dotted path and push it as a table of keys, the whole path is kept
+// at index 0 for error messages
+static void path_read( Transport *tpt, lua_State *L )
 {
-  int i, stackpos, good_function, nargs;
   u32 len;
+  int n = 0;
   char *funcname;
   char *token = NULL;
 
-  // read function name
-  len = transport_read_u32( tpt ); /* function name string length */ 
-  funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
-    
-  // get function
-  // @@@ perhaps handle more like variables instead of using a long string?
-  // @@@ also strtok is not thread safe
+  len = transport_read_u32( tpt ); // function name string length
+  funcname = transport_read_scratch( tpt, len );
+
+  lua_newtable( L );
+  lua_pushlstring( L, funcname, len );
+  lua_rawseti( L, -2, 0 );
   token = strtok( funcname, "." );
-  lua_getglobal( L, token );
-  token = strtok( NULL, "." );
   while( token != NULL )
   {
-    lua_getfield( L, -1, token );
+    lua_pushstring( L, token );
+    lua_rawseti( L, -2, ++ n );
+    token = strtok( NULL, "." );
+  }
+}
+
+// read a path number and push the keys of that path
+static void path_get( Transport *tpt, lua_State *L )
+{
+  struct exception e;
+  uint64_t id = transport_read_uvarint( tpt );
+
+  if( id == 0 || id > tpt->paths_count )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->paths_ref );
+  lua_rawgeti( L, -1, ( int )id );
+  lua_remove( L, -2 );
+}
+
+// number the path whose keys are at the top of the stack, returns the
+// number or 0 if the connection has numbered as many as it may
+static u32 path_add( Transport *tpt, lua_State *L )
+{
+  if( tpt->paths_count >= TRANSPORT_PATH_IDS )
+    return 0;
+
+  if( tpt->paths_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    tpt->paths_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->paths_ref );
+  lua_pushvalue( L, -2 );
+  lua_rawseti( L, -2, ++ tpt->paths_count );
+  lua_pop( L, 1 );
+  return tpt->paths_count;
+}
+
+// push the value the path with keys at the given index leads to
+static void path_resolve( lua_State *L, int keys_index )
+{
+  int i, n = lua_objlen( L, keys_index );
+
+  lua_pushvalue( L, LUA_GLOBALSINDEX );
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_rawgeti( L, keys_index, i );
+    lua_gettable( L, -2 );
     lua_remove( L, -2 );
+  }
+}
+
+//****************************************************************************
+// lua remote function server
+//   read function call data and execute the function. this function empties the
+//   stack on entry and exit. This sets a custom error handler to catch errors 
+//   around the function call.
+
+static void read_cmd_call( Transport *tpt, lua_State *L, u8 cmd )
+{
+  int i, stackpos, good_function, nargs, error_code = 0;
+  u32 id = 0;
+  size_t len;
+
+  // get function, leaving its name in its place if it can't be called
+  if( cmd == RPC_CMD_CALL_ID || ( tpt->options & RPC_OPT_PATHID ) )
+  {
+    if( cmd == RPC_CMD_CALL_ID )
+      path_get( tpt, L );
+    else
+      path_read( tpt, L );
+    path_resolve( L, lua_gettop( L ) );
+    good_function = LUA_ISCALLABLE( L, -1 );
+    if( !good_function )
+    {
+      lua_rawgeti( L, -2, 0 );
+      lua_replace( L, -2 );
+    }
+    else if( cmd == RPC_CMD_CALL )
+    {
+      lua_pushvalue( L, -2 );
+      id = path_add( tpt, L );
+      lua_pop( L, 1 );
+    }
+    lua_remove( L, -2 );
+  }
+  else
+  {
+    char *funcname;
+    char *token = NULL;
+
+    // read function name
+    len = transport_read_u32( tpt ); /* function name string length */ 
+    funcname = transport_read_scratch( tpt, len );
+    
+    // @@@ perhaps handle more like variables instead of using a long string?
+    // @@@ also strtok is not thread safe
+    token = strtok( funcname, "." );
+    lua_getglobal( L, token );
     token = strtok( NULL, "." );
+    while( token != NULL )
+    {
+      lua_getfield( L, -1, token );
+      lua_remove( L, -2 );
+      token = strtok( NULL, "." );
+    }
+    good_function = LUA_ISCALLABLE( L, -1 );
+
+    // keep the name for the error reply in place of the function, the scratch
+    // buffer holding it is reused while reading the arguments
+    if( !good_function )
+    {
+      for( i = 0; i < len; i ++ ) // undo strtok
+        if( funcname[ i ] == 0 )
+          funcname[ i ] = '.';
+      lua_pushlstring( L, funcname, len );
+      lua_replace( L, -2 );
+    }
   }
   stackpos = lua_gettop( L ) - 1;
-  good_function = LUA_ISCALLABLE( L, -1 );
 
   // read number of arguments
   nargs = transport_read_u32( tpt );
@@ -212,44 +408,44 @@ static void read_cmd_call( Transport *tpt, lua_State *L )
 
   // call the function
   if( good_function )
-  {
-    int nret, error_code;
     error_code = lua_pcall( L, nargs, LUA_MULTRET, 0 );
-    
-    // handle errors
 
-    TRANSPORT_START_WRITING(tpt);
+  TRANSPORT_START_WRITING(tpt);
 
-    if ( error_code )
-    {
-      size_t len;
-      const char *errmsg;
-      errmsg = lua_tolstring (L, -1, &len);
-      transport_write_u8( tpt, 1 );
-      transport_write_u32( tpt, error_code );
-      transport_write_u32( tpt, len );
-      transport_write_string( tpt, errmsg, len );
-    }
-    else
-    {
-      // pass the return values back to the caller
-      transport_write_u8( tpt, 0 );
-      nret = lua_gettop( L ) - stackpos;
-      transport_write_u32( tpt, nret );
-      for ( i = 0; i < nret; i ++ )
-        write_variable( tpt, L, stackpos + 1 + i );
-    }
-  }
-  else
+  // a call by name is answered with the number given to the path, if any
+  if( cmd == RPC_CMD_CALL && ( tpt->options & RPC_OPT_PATHID ) )
+    transport_write_uvarint( tpt, id );
+
+  if( !good_function )
   {
     // bad function
     const char *msg = "undefined function: ";
-    int errlen = strlen( msg ) + len;
+    const char *name = lua_tolstring( L, stackpos + 1, &len );
+
     transport_write_u8( tpt, 1 );
     transport_write_u32( tpt, LUA_ERRRUN );
-    transport_write_u32( tpt, errlen );
+    transport_write_u32( tpt, strlen( msg ) + len );
     transport_write_string( tpt, msg, strlen( msg ) );
-    transport_write_string( tpt, funcname, len );
+    transport_write_string( tpt, name, len );
+  }
+  else if ( error_code )
+  {
+    // handle errors
+    const char *errmsg;
+    errmsg = lua_tolstring (L, -1, &len);
+    transport_write_u8( tpt, 1 );
+    transport_write_u32( tpt, error_code );
+    transport_write_u32( tpt, len );
+    transport_write_string( tpt, errmsg, len );
+  }
+  else
+  {
+    // pass the return values back to the caller
+    int nret = lua_gettop( L ) - stackpos;
+    transport_write_u8( tpt, 0 );
+    transport_write_u32( tpt, nret );
+    for ( i = 0; i < nret; i ++ )
+      write_variable( tpt, L, stackpos + 1 + i );
   }
   // empty the stack
   lua_settop ( L, 0 );
@@ -264,9 +460,7 @@ static void read_cmd_get( Transport *tpt, lua_State *L )
 
   // read function name
   len = transport_read_u32( tpt ); // function name string length 
-  funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
+  funcname = transport_read_scratch( tpt, len );
 
   // get function
   // @@@ perhaps handle more like variables instead of using a long string?
@@ -299,9 +493,7 @@ static void read_cmd_newindex( Transport *tpt, lua_State *L )
 
   // read function name
   len = transport_read_u32( tpt ); // function name string length
-  funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
+  funcname = transport_read_scratch( tpt, len );
 
   // get function
   // @@@ perhaps handle more like variables instead of using a long string?
@@ -349,12 +541,335 @@ static void read_cmd_newindex( Transport *tpt, lua_State *L )
 }
 
 
+// run a command read from the transport
+static void server_command( lua_State *L, Transport *tpt, u8 cmd )
+{
+  struct exception e;
+
+  switch ( cmd )
+  {
+    case RPC_CMD_CALL:  // call function
+    case RPC_CMD_CALL_ID: // call function by path number
+#ifdef HELPER_WAIT
+      transport_write_u8( tpt, RPC_READY );
+#endif
+      read_cmd_call( tpt, L, cmd );
+      break;
+    case RPC_CMD_GET: // get server-side variable for client
+#ifdef HELPER_WAIT
+      transport_write_u8( tpt, RPC_READY );
+#endif
+      read_cmd_get( tpt, L );
+      break;
+    case RPC_CMD_CON: //  allow client to renegotiate active connection
+      server_negotiate( tpt, L );
+      break;
+    case RPC_CMD_NEWINDEX: // assign new variable on server
+#ifdef HELPER_WAIT
+      transport_write_u8( tpt, RPC_READY );
+#endif
+      read_cmd_newindex( tpt, L );
+      break;
+    default: // complain and throw exception if unknown command
+#ifdef HELPER_WAIT
+      transport_write_u8( tpt, RPC_UNSUPPORTED_CMD );
+#endif
+      e.type = nonfatal;
+      e.errnum = ERR_COMMAND;
+      Throw( e );
+  }
+}
+
+#ifdef LUARPC_ENABLE_EPOLL
+//****************************************************************************
+// commands of event driven servers
+//   a command is only decoded once all of it has arrived, so a client that
+//   sends slowly never holds up the others. what comes with each read is
+//   scanned to find the end of the command, if it takes more than one read
+//   the bytes are gathered in the connection until the rest is there.
+
+// lay out the parts of a command following its command byte for the scan
+static void server_scan_command( ServerConn *conn, u8 cmd )
+{
+  struct exception e;
+  TransportScan *s = &conn->scan;
+
+  // connection must be established to issue any other commands
+  if( !conn->negotiated && cmd != RPC_CMD_CON )
+  {
+    e.type = fatal;
+    e.errnum = ERR_COMMAND;
+    Throw( e );
+  }
+
+  switch( cmd )
+  {
+    case RPC_CMD_CALL: // function name and arguments
+      transport_scan_push( s, TRANSPORT_SCAN_ARGS, 0 );
+      transport_scan_push( s, TRANSPORT_SCAN_STRING, 0 );
+      break;
+    case RPC_CMD_CALL_ID: // path number and arguments
+      transport_scan_push( s, TRANSPORT_SCAN_ARGS, 0 );
+      transport_scan_push( s, TRANSPORT_SCAN_UVARINT, 0 );
+      break;
+    case RPC_CMD_GET: // variable name
+      transport_scan_push( s, TRANSPORT_SCAN_STRING, 0 );
+      break;
+    case RPC_CMD_CON: // header
+      transport_scan_push( s, TRANSPORT_SCAN_HEADER, 0 );
+      break;
+    case RPC_CMD_NEWINDEX: // table name, key and value
+      transport_scan_push( s, TRANSPORT_SCAN_VARS, 2 );
+      transport_scan_push( s, TRANSPORT_SCAN_STRING, 0 );
+      break;
+    default: // refused once it is read
+      break;
+  }
+  transport_scan_push( s, TRANSPORT_SCAN_BYTES, 1 );
+}
+
+// append the read-ahead bytes of a connection to its gathered ones. the
+// buffer grows in power of 2 steps, but a string or block the scan is
+// inside gets exactly the room it still needs, so a large argument is held
+// once rather than in a buffer up to twice its size
+static void server_conn_keep( ServerConn *conn )
+{
+  struct exception e;
+  Transport *tpt = &conn->tpt;
+  TransportScan *s = &conn->scan;
+  u32 n = transport_buffered( tpt );
+  uint64_t need = ( uint64_t )conn->pend_len + n;
+
+  if( need > conn->pend_size )
+  {
+    uint64_t size = 256;
+    u8 *p = NULL;
+
+    while( size < need )
+      size <<= 1;
+    if( s->skip > 0 && ( uint64_t )s->pos + s->skip >= need )
+      size = s->pos + s->skip;
+    if( size <= 0xFFFFFFFF )
+      p = ( u8 * )realloc( conn->pend, ( size_t )size );
+    if( p == NULL )
+    {
+      e.errnum = ENOMEM;
+      e.type = fatal;
+      Throw( e );
+    }
+    conn->pend = p;
+    conn->pend_size = ( u32 )size;
+  }
+  memcpy( conn->pend + conn->pend_len, tpt->rbuf + tpt->rbuf_pos, n );
+  conn->pend_len += n;
+  tpt->rbuf_pos += n;
+}
+
+// drop the gathered bytes a command was read from, those after it are kept
+// for the next one. returns how many were read.
+static u32 server_conn_settle( ServerConn *conn )
+{
+  u32 used;
+
+  if( !conn->pend_run )
+    return 0;
+  transport_gather_end( &conn->tpt );
+  used = conn->tpt.gathered_used;
+  memmove( conn->pend, conn->pend + used, conn->pend_len - used );
+  conn->pend_len -= used;
+  conn->pend_run = 0;
+  if( conn->pend_len == 0 && conn->pend_size > TRANSPORT_SCRATCH_KEEP )
+  {
+    free( conn->pend );
+    conn->pend = NULL;
+    conn->pend_size = 0;
+  }
+  return used;
+}
+
+// run a command that has arrived, the file payloads spooled for it are let
+// go once it is read
+static void server_conn_run( lua_State *L, ServerConn *conn )
+{
+#ifdef LUARPC_ENABLE_FILE
+  conn->spool = NULL;
+#endif
+  TRANSPORT_START_READING(&conn->tpt);
+  server_command( L, &conn->tpt, transport_read_u8( &conn->tpt ) );
+  conn->negotiated = 1;
+  conn->link_errs = 0;
+  TRANSPORT_STOP(&conn->tpt);
+  transport_files_reset( &conn->tpt, L );
+}
+
+#ifdef LUARPC_ENABLE_FILE
+// write the bytes of a file payload that are there to its spool file, returns
+// how many were taken
+static u32 server_conn_spool( ServerConn *conn, const u8 *buffer, u32 length )
+{
+  TransportScan *s = &conn->scan;
+
+  if( length > s->file_left )
+    length = s->file_left;
+  transport_spool_put( conn->spool, buffer, length, s->file_left );
+  s->file_left -= length;
+  return length;
+}
+#endif
+
+// take what was read ahead on a connection and run the commands it completes
+static void server_conn_gather( lua_State *L, ServerConn *conn )
+{
+  struct exception e;
+  Transport *tpt = &conn->tpt;
+  TransportScan *s = &conn->scan;
+  u32 length;
+
+#ifdef LUARPC_ENABLE_FILE
+  // more of a file payload goes straight to its spool file, the bytes of the
+  // command before it are gathered and those after it come next
+  if( s->file_left > 0 )
+  {
+    tpt->rbuf_pos += server_conn_spool( conn, tpt->rbuf + tpt->rbuf_pos,
+                                        transport_buffered( tpt ) );
+    if( s->file_left > 0 )
+      return;
+  }
+#endif
+
+  // a command that came with one read is decoded where it is
+  if( conn->pend_len == 0 )
+  {
+    if( s->pos == 0 && s->depth == 0 )
+      server_scan_command( conn, tpt->rbuf[ tpt->rbuf_pos ] );
+    if( transport_scan( tpt, s, tpt->rbuf + tpt->rbuf_pos, transport_buffered( tpt ) ) &&
+        !s->file )
+    {
+      transport_scan_reset( s );
+      server_conn_run( L, conn );
+      return;
+    }
+  }
+
+  server_conn_keep( conn );
+  while( conn->pend_len > 0 )
+  {
+    if( s->pos == 0 && s->depth == 0 )
+      server_scan_command( conn, conn->pend[ 0 ] );
+    if( !transport_scan( tpt, s, conn->pend, conn->pend_len ) )
+      return;
+
+#ifdef LUARPC_ENABLE_FILE
+    // a file payload is taken out of the command as it arrives, the decoder
+    // finds it spooled
+    if( s->file )
+    {
+      s->file = 0;
+      conn->spool = transport_spool_file( tpt, L, s->file_left );
+      length = server_conn_spool( conn, conn->pend + s->pos, conn->pend_len - s->pos );
+      memmove( conn->pend + s->pos, conn->pend + s->pos + length,
+               conn->pend_len - s->pos - length );
+      conn->pend_len -= length;
+      if( s->file_left > 0 )
+        return;
+      continue;
+    }
+#endif
+
+    // the command must be read exactly as scanned
+    length = s->pos;
+    transport_scan_reset( s );
+    transport_gather( tpt, conn->pend, conn->pend_len );
+    conn->pend_run = 1;
+    server_conn_run( L, conn );
+    if( !transport_is_open( tpt ) ) // the server was shut down
+      return;
+    if( server_conn_settle( conn ) != length )
+    {
+      e.type = fatal;
+      e.errnum = ERR_PROTOCOL;
+      Throw( e );
+    }
+  }
+}
+
+// serve a connection with data to read. commands that were read ahead are
+// run as well, as the event multiplexer won't report them. errors only close
+// the connection they happened on.
+static void server_conn_dispatch( lua_State *L, ServerHandle *handle, ServerConn *conn )
+{
+  struct exception e;
+
+  Try
+  {
+    // a lua error may have left the last command in use
+    if( conn->pend_run )
+    {
+      server_conn_settle( conn );
+      transport_files_reset( &conn->tpt, L );
+    }
+
+    // a single read doesn't block, the link has data
+    if( transport_buffered( &conn->tpt ) == 0 )
+      transport_read_ahead( &conn->tpt );
+    while( transport_buffered( &conn->tpt ) > 0 )
+      server_conn_gather( L, conn );
+  }
+  Catch( e )
+  {
+    transport_scan_reset( &conn->scan );
+    transport_files_reset( &conn->tpt, L );
+#ifdef LUARPC_ENABLE_FILE
+    conn->spool = NULL;
+#endif
+    if( !transport_is_open( &conn->tpt ) ) // closed by a called function
+      server_conn_remove( L, handle, conn );
+    else
+    {
+      server_conn_settle( conn );
+      if( e.type != nonfatal || e.errnum == ERR_EOF ||
+          ++conn->link_errs > MAX_LINK_ERRS )
+        server_conn_remove( L, handle, conn );
+    }
+  }
+}
+
+// wait for activity on any connection and serve it
+static void server_dispatch_events( lua_State *L, ServerHandle *handle )
+{
+  struct exception e;
+  ServerConn *ready[ MAX_EVENTS ];
+  int i, n;
+
+  n = transport_wait_events( handle, ready, MAX_EVENTS, -1 );
+
+  // stop if a called function shut the server down
+  handle->dispatching = 1;
+  for( i = 0; i < n && transport_is_open( &handle->ltpt ); i ++ )
+    server_conn_dispatch( L, handle, ready[ i ] );
+  handle->dispatching = 0;
+
+  // the shutdown is finished by the caller, as for a single connection
+  if( !transport_is_open( &handle->ltpt ) )
+  {
+    e.errnum = ERR_CLOSED;
+    e.type = fatal;
+    Throw( e );
+  }
+}
+#endif
+
 void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
 {  
   struct exception e;
 
   Try 
   {
+#ifdef LUARPC_ENABLE_EPOLL
+    if ( handle->epfd >= 0 )
+      server_dispatch_events( L, handle );
+    else
+#endif
     // if accepting transport is open, read function calls
     if ( transport_is_open( &handle->atpt ) )
     {
@@ -362,37 +877,7 @@ void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
       {
         TRANSPORT_START_READING(&handle->atpt);
 
-        switch ( transport_read_u8( &handle->atpt ) )
-        {
-          case RPC_CMD_CALL:  // call function
-#ifdef HELPER_WAIT
-            transport_write_u8( &handle->atpt, RPC_READY );
-#endif
-            read_cmd_call( &handle->atpt, L );
-            break;
-          case RPC_CMD_GET: // get server-side variable for client
-#ifdef HELPER_WAIT
-            transport_write_u8( &handle->atpt, RPC_READY );
-#endif
-            read_cmd_get( &handle->atpt, L );
-            break;
-          case RPC_CMD_CON: //  allow client to renegotiate active connection
-            server_negotiate( &handle->atpt );
-            break;
-          case RPC_CMD_NEWINDEX: // assign new variable on server
-#ifdef HELPER_WAIT
-            transport_write_u8( &handle->atpt, RPC_READY );
-#endif
-            read_cmd_newindex( &handle->atpt, L );
-            break;
-          default: // complain and throw exception if unknown command
-#ifdef HELPER_WAIT
-            transport_write_u8(&handle->atpt, RPC_UNSUPPORTED_CMD );
-#endif
-            e.type = nonfatal;
-            e.errnum = ERR_COMMAND;
-            Throw( e );
-        }
+        server_command( L, &handle->atpt, transport_read_u8( &handle->atpt ) );
         
         handle->link_errs = 0;
 
@@ -429,7 +914,7 @@ void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
       switch ( transport_read_u8( &handle->atpt ) )
       {
         case RPC_CMD_CON:
-          server_negotiate( &handle->atpt );
+          server_negotiate( &handle->atpt, L );
           break;
         default: // connection must be established to issue any other commands
           e.type = nonfatal;
@@ -443,12 +928,12 @@ void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
     switch( e.type )
     {
       case fatal:
-        server_handle_shutdown( handle );
+        server_handle_shutdown( L, handle );
         deal_with_error( L, 0, errorString( e.errnum ) );
         break;
         
       case nonfatal:
-        transport_close( &handle->atpt );
+        transport_close( &handle->atpt, L );
         break;
         
       default:
@@ -98,4 +98,59 @@ end
 s=("The quick brown fox jumps over the lazy dog"):rep(100000)
 print('do'); assert(slave.mirror(s) == s, "huge string return failed")
 
+-- repeated calls go by the path number the server gave on the first one
+for i=1,10 do
+  print('do'); assert(slave.mirror(i) == i, "repeated call failed")
+  print('do'); assert(slave.string.upper("abc") == "ABC", "repeated nested call failed")
+end
+
+-- a path two tables deep, by name and then by number
+for i=1,2 do
+  print('do'); assert(slave.nested.sub.mirror(i) == i, "deeply nested call failed")
+end
+
+-- a function sent again goes by its hash
+for i=1,3 do
+  print('do'); assert(slave.execrfunc(squareval, i) == i*i, "repeated function failed")
+end
+
+-- values encoded to a string and back, without a link
+shared = {1, 2, 3}
+enc = {a = shared, b = shared, nums = {}, f = squareval}
+for i=1,100 do enc.nums[i] = i / 2 end
+enc.self = enc
+dec = rpc.decode(rpc.encode(enc))
+print('do'); assert(dec.a == dec.b and dec.a[3] == 3, "shared table not kept by encoding")
+print('do'); assert(dec.self == dec, "cyclic table not kept by encoding")
+print('do'); assert(dec.nums[1] == 0.5 and dec.nums[100] == 50, "number array not kept by encoding")
+print('do'); assert(dec.f(9) == 81, "function not kept by encoding")
+dec = rpc.decode(rpc.encode(enc.nums, {numarray = false, compress = false}))
+print('do'); assert(#dec == 100 and dec[51] == 25.5, "encoding without options failed")
+
+if rpc.mode == "tcpip" then
+  -- a file sent as a payload and returned
+  fname = os.tmpname()
+  f = io.open(fname, "wb"); f:write(s); f:close()
+  r = slave.mirror(rpc.file(fname))
+  print('do'); assert(r:size() == #s and r:read() == s, "file return failed")
+  os.remove(fname)
+
+  -- pooled connections
+  pool = rpc.pool("localhost", 12346, 2)
+  h = pool:get()
+  print('do'); assert(h.mirror(7) == 7, "pooled connection failed")
+  pool:put(h)
+  rpc.close(pool)
+end
+
 rpc.close (slave)
+
+if rpc.mode == "tcpip" and arg and arg[1] == "wait" then
+  -- "lua test-client.lua wait", against the server started the same way:
+  -- the same server over a unix domain socket, which is then stopped from
+  -- inside a call once the tcp connections are closed
+  local uslave = rpc.connect("unix:/tmp/luarpc-test.sock")
+  print('do'); assert(uslave.mirror("unix") == "unix", "unix socket call failed")
+  print('do'); assert(not pcall(uslave.stop), "server did not stop")
+  rpc.close(uslave)
+end
@@ -36,6 +36,12 @@ function mirror( input )
 	return input
 end
 
+nested = { sub = {} }
+
+function nested.sub.mirror( input )
+	return input
+end
+
 
 yarg = {}
 
@@ -49,7 +55,27 @@ io.write ("server started\n")
 -- rpc.server ("/dev/ptys0"); -- use for serial mode
 -- rpc.server ("/dev/ptmx"); -- use for serial mode
 
-if rpc.mode == "tcpip" then
+if rpc.mode == "tcpip" and arg and arg[1] == "wait" then
+  -- "lua test-server.lua wait": the client also comes in over a unix domain
+  -- socket, rpc.wait serves both until a client calls stop
+  io.write("TCP/IP and Unix Socket Server Started\n")
+  local handles = { rpc.listen(12346), rpc.listen("unix:/tmp/luarpc-test.sock") }
+  local running = true
+  function stop ()
+    running = false
+    for _, handle in ipairs(handles) do
+      rpc.close(handle)
+    end
+  end
+  while running do
+    for _, handle in ipairs(rpc.wait(handles)) do
+      -- the dispatch that ran stop reports the closed server
+      local ok, err = pcall(rpc.dispatch, handle)
+      if not ok and running then error(err) end
+    end
+  end
+  io.write("server stopped\n")
+elseif rpc.mode == "tcpip" then
   io.write("TCP/IP Server Started\n")
   rpc.server(12346);
 elseif rpc.mode == "serial" then
@@ -57,12 +83,12 @@ elseif rpc.mode == "serial" then
   rpc.server("/dev/ptys0");
 end
 
--- an alternative way
+-- an alternative way, rpc.wait sleeps until a handle has something to do
 
 -- count = 0;
 -- handle = rpc.listen ("/dev/ptys0");
 -- while 1 do
---   if rpc.peek (handle) then
+--   if #rpc.wait ({handle}, 1) > 0 then
 --     io.write ("dispatch\n")
 --     rpc.dispatch (handle)
 --   else
@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 #ifdef __MINGW32__
 void *alloca(size_t);
 #else
@@ -38,6 +39,8 @@ void *alloca(size_t);
 #endif
 
 #include "luarpc_rpc.h"
+#include "lzf.h"
+#include "bswap.h"
 
 
 //#ifdef BUILD_RPC
@@ -99,8 +102,27 @@ enum {
   RPC_TABLE_END,
   RPC_FUNCTION,
   RPC_FUNCTION_END,
-  RPC_REMOTE
+  RPC_REMOTE,
+  RPC_FILE,
+  RPC_INTEGER,
+  RPC_STRING8,
+  RPC_STRING16,
+  RPC_ARRAY,
+  RPC_STRREF,
+  RPC_TABLEREF,
+  RPC_COMPRESSED,
+  RPC_NUMARRAY,
+  RPC_FUNCREF
 };
+
+// Strings up to RPC_SHORT_STRING_MAX bytes have their length added to the tag
+enum { RPC_SHORT_STRING = 0x80, RPC_SHORT_STRING_MAX = 63 };
+
+// Strings at least this long are numbered when the string reference option
+// is on, tables are with the table reference option. a repeat within the same
+// value is sent as its number.
+enum { RPC_STRREF_MIN = 4 };
+#define RPC_OPT_REFS ( RPC_OPT_STRREF | RPC_OPT_TABLEREF )
 #if 0
 // RPC Commands
 enum
@@ -108,7 +130,8 @@ enum
   RPC_CMD_CALL = 1,
   RPC_CMD_GET,
   RPC_CMD_CON,
-  RPC_CMD_NEWINDEX
+  RPC_CMD_NEWINDEX,
+  RPC_CMD_CALL_ID
 };
 
 // RPC Status Codes
@@ -119,7 +142,7 @@ enum
   RPC_DONE
 };
 
-enum { RPC_PROTOCOL_VERSION = 3 };
+enum { RPC_PROTOCOL_VERSION = 4 };
 
 
 // return a string representation of an error number 
@@ -140,6 +163,411 @@ static const char * errorString( int n )
 
 #endif
 
+// **************************************************************************
+// transport output buffering
+//   the write primitives below accumulate a whole request or reply in the
+//   transport's output buffer, which is handed to the link layer in one piece
+//   when the transport leaves write mode (or the buffer fills up). large lua
+//   strings aren't copied, they are queued by reference between the buffered
+//   segments and the whole queue goes out with one vectored write.
+
+// drop queued output and release the strings it was holding on to
+static void transport_discard_output( Transport *tpt )
+{
+  int i;
+
+  for( i = 0; i < tpt->wq_len; i ++ )
+    if( tpt->wq_ref[ i ] != LUA_NOREF )
+      luaL_unref( tpt->wq_L, LUA_REGISTRYINDEX, tpt->wq_ref[ i ] );
+  tpt->wq_len = 0;
+  tpt->wbuf_len = 0;
+  tpt->wbuf_seg = 0;
+}
+
+// sessions are numbered across all transports, so a number learned in one
+// is never taken for another
+static u32 transport_sessions = 0;
+
+static u32 transport_next_session( void )
+{
+  if( ++ transport_sessions == 0 )
+    ++ transport_sessions;
+  return transport_sessions;
+}
+
+// set up empty buffers on a new transport
+void transport_buffer_init( Transport *tpt )
+{
+  tpt->options = 0;
+  tpt->memory = 0;
+  tpt->wq_len = 0;
+  tpt->wq_L = NULL;
+  tpt->wbuf_len = 0;
+  tpt->wbuf_seg = 0;
+  tpt->rbuf_pos = 0;
+  tpt->rbuf_len = 0;
+  tpt->rbuf = tpt->rbuf_mem;
+  tpt->gathered = NULL;
+  tpt->gathered_used = 0;
+  tpt->scratch = NULL;
+  tpt->scratch_size = 0;
+  tpt->zbuf = NULL;
+  tpt->zbuf_size = 0;
+  tpt->zbuf_len = 0;
+  tpt->capture = 0;
+  tpt->refs_index = 0;
+  tpt->refs_count = 0;
+  tpt->paths_ref = LUA_NOREF;
+  tpt->paths_count = 0;
+  tpt->session = transport_next_session();
+  tpt->funcs_ref = LUA_NOREF;
+  tpt->funcs_count = 0;
+  tpt->funcs_sent_count = 0;
+  tpt->files_ref = LUA_NOREF;
+  tpt->files_count = 0;
+  tpt->files_read = 0;
+}
+
+// release the string decoding buffer
+static void transport_scratch_free( Transport *tpt )
+{
+  free( tpt->scratch );
+  tpt->scratch = NULL;
+  tpt->scratch_size = 0;
+}
+
+// release the compression buffer
+static void transport_zbuf_free( Transport *tpt )
+{
+  free( tpt->zbuf );
+  tpt->zbuf = NULL;
+  tpt->zbuf_size = 0;
+  tpt->zbuf_len = 0;
+}
+
+// forget the function paths numbered and the functions cached in a session,
+// called when headers are exchanged and when the transport is closed. the
+// registry is shared by all threads, so they are released with the state of
+// the caller rather than the one that made them, which may be gone.
+void transport_session_reset( Transport *tpt, lua_State *L )
+{
+  if( tpt->paths_ref != LUA_NOREF )
+    luaL_unref( L, LUA_REGISTRYINDEX, tpt->paths_ref );
+  tpt->paths_ref = LUA_NOREF;
+  tpt->paths_count = 0;
+  tpt->session = transport_next_session();
+  if( tpt->funcs_ref != LUA_NOREF )
+    luaL_unref( L, LUA_REGISTRYINDEX, tpt->funcs_ref );
+  tpt->funcs_ref = LUA_NOREF;
+  tpt->funcs_count = 0;
+  tpt->funcs_sent_count = 0;
+}
+
+// let go of the file payloads spooled for a command, once it has been read or
+// abandoned. values holding them keep them open.
+void transport_files_reset( Transport *tpt, lua_State *L )
+{
+  if( tpt->files_ref != LUA_NOREF )
+    luaL_unref( L, LUA_REGISTRYINDEX, tpt->files_ref );
+  tpt->files_ref = LUA_NOREF;
+  tpt->files_count = 0;
+  tpt->files_read = 0;
+}
+
+// discard any buffered data, called when a transport is closed
+void transport_buffer_reset( Transport *tpt, lua_State *L )
+{
+  transport_discard_output( tpt );
+  tpt->rbuf_pos = 0;
+  tpt->rbuf_len = 0;
+  tpt->rbuf = tpt->rbuf_mem;
+  tpt->gathered = NULL;
+  tpt->capture = 0;
+  transport_scratch_free( tpt );
+  transport_zbuf_free( tpt );
+  transport_files_reset( tpt, L );
+  transport_session_reset( tpt, L );
+}
+
+// move buffered bytes not yet covered by the send queue into it
+static void transport_queue_segment( Transport *tpt )
+{
+  if( tpt->wbuf_len > tpt->wbuf_seg )
+  {
+    tpt->wq[ tpt->wq_len ].base = tpt->wbuf + tpt->wbuf_seg;
+    tpt->wq[ tpt->wq_len ].len = tpt->wbuf_len - tpt->wbuf_seg;
+    tpt->wq_ref[ tpt->wq_len ] = LUA_NOREF;
+    tpt->wq_len ++;
+    tpt->wbuf_seg = tpt->wbuf_len;
+  }
+}
+
+// hand buffered output to the link layer 
+void transport_flush( Transport *tpt )
+{
+  u32 len = tpt->wbuf_len;
+
+  if( tpt->wq_len == 0 )
+  {
+    if( len == 0 )
+      return;
+
+    // reset first so that a failed write doesn't get retried
+    tpt->wbuf_len = 0;
+    tpt->wbuf_seg = 0;
+    transport_write_buffer( tpt, tpt->wbuf, len );
+    return;
+  }
+
+  // queued strings stay anchored until the write is done, if it fails they
+  // are released when the transport is closed or written to again
+  transport_queue_segment( tpt );
+  transport_write_vector( tpt, tpt->wq, tpt->wq_len );
+  transport_discard_output( tpt );
+}
+
+static void transport_zbuf_put( Transport *tpt, const u8 *buffer, u32 length );
+
+// append to the output buffer, blocks that won't fit go straight to the link
+static void transport_put( Transport *tpt, const u8 *buffer, u32 length )
+{
+  if( tpt->capture )
+  {
+    transport_zbuf_put( tpt, buffer, length );
+    return;
+  }
+  if( tpt->wbuf_len + length > TRANSPORT_WBUF_SIZE )
+  {
+    transport_flush( tpt );
+    if( length >= TRANSPORT_WBUF_SIZE )
+    {
+      transport_write_buffer( tpt, buffer, length );
+      return;
+    }
+  }
+  memcpy( tpt->wbuf + tpt->wbuf_len, buffer, length );
+  tpt->wbuf_len += length;
+}
+
+// queue the string at the given stack index without copying it, the string is
+// anchored in the registry until it has been sent
+static void transport_put_ref( Transport *tpt, lua_State *L, int index, const u8 *buffer, u32 length )
+{
+  struct exception e;
+  TRANSPORT_VERIFY_WRITE;
+
+  // a value being compressed is collected in one piece
+  if( tpt->capture )
+  {
+    transport_zbuf_put( tpt, buffer, length );
+    return;
+  }
+
+  // leave room for buffered bytes on either side of this block
+  if( tpt->wq_len + 3 > TRANSPORT_WQ_LEN )
+    transport_flush( tpt );
+
+  transport_queue_segment( tpt );
+  lua_pushvalue( L, index );
+  tpt->wq[ tpt->wq_len ].base = buffer;
+  tpt->wq[ tpt->wq_len ].len = length;
+  tpt->wq_ref[ tpt->wq_len ] = luaL_ref( L, LUA_REGISTRYINDEX );
+  tpt->wq_len ++;
+  tpt->wq_L = L;
+}
+
+// **************************************************************************
+// transport input buffering
+//   the link is read in TRANSPORT_RBUF_SIZE chunks, so a typical message is
+//   pulled in with one or two reads and decoded from memory.
+
+// number of bytes that can be read without touching the link
+int transport_buffered( Transport *tpt )
+{
+  return tpt->rbuf_len - tpt->rbuf_pos;
+}
+
+// refill the drained read-ahead buffer with what one read of the link gives,
+// which doesn't block if the link is known to have data
+void transport_read_ahead( Transport *tpt )
+{
+  tpt->rbuf_pos = 0;
+  tpt->rbuf_len = 0;
+  tpt->rbuf_len = transport_read_buffer( tpt, tpt->rbuf, TRANSPORT_RBUF_SIZE );
+}
+
+// read gathered bytes of a command before the read-ahead buffer. they are
+// read until used up, the command is answered or transport_gather_end is
+// called, gathered_used then tells how many were read.
+void transport_gather( Transport *tpt, u8 *buffer, u32 length )
+{
+  tpt->rbuf_mem_pos = tpt->rbuf_pos;
+  tpt->rbuf_mem_len = tpt->rbuf_len;
+  tpt->gathered = buffer;
+  tpt->rbuf = buffer;
+  tpt->rbuf_pos = 0;
+  tpt->rbuf_len = length;
+}
+
+// go on with the read-ahead buffer
+void transport_gather_end( Transport *tpt )
+{
+  if( tpt->gathered == NULL )
+    return;
+  tpt->gathered_used = tpt->rbuf_pos;
+  tpt->gathered = NULL;
+  tpt->rbuf = tpt->rbuf_mem;
+  tpt->rbuf_pos = tpt->rbuf_mem_pos;
+  tpt->rbuf_len = tpt->rbuf_mem_len;
+}
+
+// fill buffer with exactly length bytes
+static void transport_get( Transport *tpt, u8 *buffer, u32 length )
+{
+  u32 n = tpt->rbuf_len - tpt->rbuf_pos;
+
+  if( n >= length )
+  {
+    memcpy( buffer, tpt->rbuf + tpt->rbuf_pos, length );
+    tpt->rbuf_pos += length;
+    return;
+  }
+
+  // a decompressed or decoded value must hold all of itself, gathered bytes
+  // go on with the read-ahead buffer
+  if( tpt->rbuf == tpt->gathered )
+  {
+    memcpy( buffer, tpt->rbuf + tpt->rbuf_pos, n );
+    tpt->rbuf_pos += n;
+    transport_gather_end( tpt );
+    transport_get( tpt, buffer + n, length - n );
+    return;
+  }
+  if( tpt->rbuf != tpt->rbuf_mem )
+  {
+    struct exception e;
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+
+  // drain what we have
+  memcpy( buffer, tpt->rbuf + tpt->rbuf_pos, n );
+  buffer += n;
+  length -= n;
+  tpt->rbuf_pos = tpt->rbuf_len = 0;
+
+  // large blocks are read straight into the destination
+  while( length >= TRANSPORT_RBUF_SIZE )
+  {
+    n = transport_read_buffer( tpt, buffer, length );
+    buffer += n;
+    length -= n;
+  }
+
+  // refill read-ahead for the rest
+  while( length > 0 )
+  {
+    tpt->rbuf_len = transport_read_buffer( tpt, tpt->rbuf, TRANSPORT_RBUF_SIZE );
+    n = tpt->rbuf_len < length ? tpt->rbuf_len : length;
+    memcpy( buffer, tpt->rbuf, n );
+    tpt->rbuf_pos = n;
+    buffer += n;
+    length -= n;
+  }
+}
+
+// make room for at least length bytes in zbuf, keeping its contents. it is
+// grown in power of 2 steps like the scratch buffer.
+static void transport_zbuf_reserve( Transport *tpt, u32 length )
+{
+  struct exception e;
+  u32 size = 256;
+  u8 *p = NULL;
+
+  if( length <= tpt->zbuf_size )
+    return;
+  while( size < length && size != 0 )
+    size <<= 1;
+  if( size != 0 )
+    p = ( u8 * )realloc( tpt->zbuf, size );
+  if( p == NULL )
+  {
+    e.errnum = ENOMEM;
+    e.type = fatal;
+    Throw( e );
+  }
+  tpt->zbuf = p;
+  tpt->zbuf_size = size;
+}
+
+// append to zbuf while a value is collected for compression
+static void transport_zbuf_put( Transport *tpt, const u8 *buffer, u32 length )
+{
+  transport_zbuf_reserve( tpt, tpt->zbuf_len + length );
+  memcpy( tpt->zbuf + tpt->zbuf_len, buffer, length );
+  tpt->zbuf_len += length;
+}
+
+// make room for more than length bytes in the scratch buffer, its old
+// contents are dropped
+static char *transport_scratch_reserve( Transport *tpt, u32 length )
+{
+  struct exception e;
+
+  if( length >= tpt->scratch_size )
+  {
+    u32 size = 256;
+
+    // old contents aren't needed, so don't realloc
+    transport_scratch_free( tpt );
+    while( size <= length && size != 0 )
+      size <<= 1;
+    if( size != 0 )
+      tpt->scratch = ( char * )malloc( size );
+    if( tpt->scratch == NULL )
+    {
+      e.errnum = ENOMEM;
+      e.type = fatal;
+      Throw( e );
+    }
+    tpt->scratch_size = size;
+  }
+
+  return tpt->scratch;
+}
+
+// read length bytes into the transport's scratch buffer, which is grown in
+// power of 2 steps and reused from message to message. the result is zero
+// terminated and stays valid until the next call.
+char *transport_read_scratch( Transport *tpt, u32 length )
+{
+  struct exception e;
+  TRANSPORT_VERIFY_READ;
+
+  transport_scratch_reserve( tpt, length );
+  transport_get( tpt, ( u8 * )tpt->scratch, length );
+  tpt->scratch[ length ] = 0;
+  return tpt->scratch;
+}
+
+// read a string and push it onto the stack. strings that have already been
+// read ahead are pushed straight from the input buffer, others are collected
+// in the scratch buffer first.
+static void transport_push_string( Transport *tpt, lua_State *L, u32 length )
+{
+  if( transport_buffered( tpt ) >= length )
+  {
+    lua_pushlstring( L, ( const char * )tpt->rbuf + tpt->rbuf_pos, length );
+    tpt->rbuf_pos += length;
+    return;
+  }
+
+  lua_pushlstring( L, transport_read_scratch( tpt, length ), length );
+  if( tpt->scratch_size > TRANSPORT_SCRATCH_KEEP )
+    transport_scratch_free( tpt );
+}
+
 // **************************************************************************
 // transport layer generics
 
@@ -148,7 +576,7 @@ void transport_read_string( Transport *tpt, const char *buffer, int length )
 {
   struct exception e;
   TRANSPORT_VERIFY_READ;
-  transport_read_buffer( tpt, ( u8 * )buffer, length );
+  transport_get( tpt, ( u8 * )buffer, length );
 }
 
 
@@ -157,7 +585,7 @@ void transport_write_string( Transport *tpt, const char *buffer, int length )
 {
   struct exception e;
   TRANSPORT_VERIFY_WRITE;
-  transport_write_buffer( tpt, ( u8 * )buffer, length );
+  transport_put( tpt, ( u8 * )buffer, length );
 }
 
 
@@ -168,7 +596,7 @@ u8 transport_read_u8( Transport *tpt )
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
   TRANSPORT_VERIFY_READ;
-  transport_read_buffer( tpt, &b, 1 );
+  transport_get( tpt, &b, 1 );
   return b;
 }
 
@@ -179,20 +607,70 @@ void transport_write_u8( Transport *tpt, u8 x )
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
   TRANSPORT_VERIFY_WRITE;
-  transport_write_buffer( tpt, &x, 1 );
+  transport_put( tpt, &x, 1 );
 }
 
+// reverse the bytes of a single number, sizes known at compile time become
+// one byte swap instruction
 static void swap_bytes( uint8_t *number, size_t numbersize )
 {
-  int i;
-  for ( i = 0 ; i < numbersize / 2 ; i ++ )
+  switch( numbersize )
   {
-    uint8_t temp = number[ i ];
-    number[ i ] = number[ numbersize - 1 - i ];
-    number[ numbersize - 1 - i ] = temp;
+    case 2: {
+      uint16_t x;
+      memcpy( &x, number, 2 );
+      x = BSWAP16( x );
+      memcpy( number, &x, 2 );
+    } break;
+    case 4: {
+      uint32_t x;
+      memcpy( &x, number, 4 );
+      x = BSWAP32( x );
+      memcpy( number, &x, 4 );
+    } break;
+    case 8: {
+      uint64_t x;
+      memcpy( &x, number, 8 );
+      x = BSWAP64( x );
+      memcpy( number, &x, 8 );
+    } break;
+    default:
+      bswap_block( number, 1, numbersize );
   }
 }
 
+union u16_bytes {
+  uint16_t i;
+  uint8_t  b[ 2 ];
+};
+
+// read a u16 from the transport 
+u16 transport_read_u16( Transport *tpt )
+{
+  union u16_bytes ub;
+  struct exception e;
+  TRANSPORT_VERIFY_OPEN;
+  TRANSPORT_VERIFY_READ;
+  transport_get( tpt, ub.b, 2 );
+  if( tpt->rd_little != tpt->loc_little )
+    swap_bytes( ( uint8_t * )ub.b, 2 );
+  return ub.i;
+}
+
+
+// write a u16 to the transport 
+void transport_write_u16( Transport *tpt, u16 x )
+{
+  union u16_bytes ub;
+  struct exception e;
+  TRANSPORT_VERIFY_OPEN;
+  TRANSPORT_VERIFY_WRITE;
+  ub.i = ( uint16_t )x;
+  if( tpt->net_little != tpt->loc_little )
+    swap_bytes( ( uint8_t * )ub.b, 2 );
+  transport_put( tpt, ub.b, 2 );
+}
+
 union u32_bytes {
   uint32_t i;
   uint8_t  b[ 4 ];
@@ -205,8 +683,8 @@ u32 transport_read_u32( Transport *tpt )
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
   TRANSPORT_VERIFY_READ;
-  transport_read_buffer ( tpt, ub.b, 4 );
-  if( tpt->net_little != tpt->loc_little )
+  transport_get( tpt, ub.b, 4 );
+  if( tpt->rd_little != tpt->loc_little )
     swap_bytes( ( uint8_t * )ub.b, 4 );
   return ub.i;
 }
@@ -222,7 +700,7 @@ void transport_write_u32( Transport *tpt, u32 x )
   ub.i = ( uint32_t )x;
   if( tpt->net_little != tpt->loc_little )
     swap_bytes( ( uint8_t * )ub.b, 4 );
-  transport_write_buffer( tpt, ub.b, 4 );
+  transport_put( tpt, ub.b, 4 );
 }
 
 // read a lua number from the transport 
@@ -233,9 +711,9 @@ lua_Number transport_read_number( Transport *tpt )
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
   TRANSPORT_VERIFY_READ;
-  transport_read_buffer ( tpt, b, tpt->lnum_bytes );
+  transport_get( tpt, b, tpt->lnum_bytes );
   
-  if( tpt->net_little != tpt->loc_little )
+  if( tpt->rd_little != tpt->loc_little )
     swap_bytes( ( uint8_t * )b, tpt->lnum_bytes );
   
   if( tpt->net_intnum != tpt->loc_intnum ) // if we differ on num types, use int
@@ -281,25 +759,25 @@ void transport_write_number( Transport *tpt, lua_Number x )
     {
       case 1: {
         int8_t y = ( int8_t )x;
-        transport_write_buffer( tpt, ( u8 * )&y, 1 );
+        transport_put( tpt, ( u8 * )&y, 1 );
       } break;
       case 2: {
         int16_t y = ( int16_t )x;
         if( tpt->net_little != tpt->loc_little )
           swap_bytes( ( uint8_t * )&y, 2 );
-        transport_write_buffer( tpt, ( u8 * )&y, 2 );
+        transport_put( tpt, ( u8 * )&y, 2 );
       } break;
       case 4: {
         int32_t y = ( int32_t )x;
         if( tpt->net_little != tpt->loc_little )
           swap_bytes( ( uint8_t * )&y, 4 );
-        transport_write_buffer( tpt,( u8 * )&y, 4 );
+        transport_put( tpt,( u8 * )&y, 4 );
       } break;
       case 8: {
         int64_t y = ( int64_t )x;
         if( tpt->net_little != tpt->loc_little )
           swap_bytes( ( uint8_t * )&y, 8 );
-        transport_write_buffer( tpt, ( u8 * )&y, 8 );
+        transport_put( tpt, ( u8 * )&y, 8 );
       } break;
       default: lua_assert(0);
     }
@@ -308,8 +786,106 @@ void transport_write_number( Transport *tpt, lua_Number x )
   {
     if( tpt->net_little != tpt->loc_little )
        swap_bytes( ( uint8_t * )&x, 8 );
-    transport_write_buffer( tpt, ( u8 * )&x, 8 );
+    transport_put( tpt, ( u8 * )&x, 8 );
+  }
+}
+
+
+// integral numbers that a double holds exactly can go as varints, -0 can't
+static int number_is_varint( lua_Number x )
+{
+  lua_Number zero = 0;
+
+  if( !( x >= -9007199254740992.0 && x <= 9007199254740992.0 ) )
+    return 0;
+  if( x == 0 )
+    return memcmp( &x, &zero, sizeof( x ) ) == 0;
+  return x == ( lua_Number )( int64_t )x;
+}
+
+// write an unsigned varint: 7 bits per byte, lowest first, with the top bit
+// set on all but the last byte
+void transport_write_uvarint( Transport *tpt, uint64_t z )
+{
+  u8 b[ 10 ];
+  int n = 0;
+
+  while( z >= 0x80 )
+  {
+    b[ n ++ ] = ( u8 )( z | 0x80 );
+    z >>= 7;
+  }
+  b[ n ++ ] = ( u8 )z;
+  transport_put( tpt, b, n );
+}
+
+// read an unsigned varint
+uint64_t transport_read_uvarint( Transport *tpt )
+{
+  struct exception e;
+  uint64_t z = 0;
+  int shift = 0;
+  u8 b;
+
+  do
+  {
+    if( shift > 63 )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = fatal;
+      Throw( e );
+    }
+    if( tpt->rbuf_pos < tpt->rbuf_len )
+      b = tpt->rbuf[ tpt->rbuf_pos ++ ];
+    else
+      transport_get( tpt, &b, 1 );
+    z |= ( uint64_t )( b & 0x7f ) << shift;
+    shift += 7;
+  } while( b & 0x80 );
+
+  return z;
+}
+
+// write an integer as a zigzag varint, the sign goes to the lowest bit so
+// small magnitudes of either sign take one or two bytes
+static void transport_write_varint( Transport *tpt, int64_t x )
+{
+  transport_write_uvarint( tpt, ( ( uint64_t )x << 1 ) ^ ( uint64_t )( x >> 63 ) );
+}
+
+// read a zigzag varint
+static int64_t transport_read_varint( Transport *tpt )
+{
+  uint64_t z = transport_read_uvarint( tpt );
+  return ( int64_t )( z >> 1 ) ^ -( int64_t )( z & 1 );
+}
+
+
+// write the tag and length of a string, as short as the options allow
+static void transport_write_string_tag( Transport *tpt, u32 len )
+{
+  if( tpt->options & RPC_OPT_SHORTSTR )
+  {
+    if( len <= RPC_SHORT_STRING_MAX )
+    {
+      transport_write_u8( tpt, ( u8 )( RPC_SHORT_STRING + len ) );
+      return;
+    }
+    if( len <= 0xff )
+    {
+      transport_write_u8( tpt, RPC_STRING8 );
+      transport_write_u8( tpt, ( u8 )len );
+      return;
+    }
+    if( len <= 0xffff )
+    {
+      transport_write_u8( tpt, RPC_STRING16 );
+      transport_write_u16( tpt, ( u16 )len );
+      return;
+    }
   }
+  transport_write_u8( tpt, RPC_STRING );
+  transport_write_u32( tpt, len );
 }
 
 
@@ -321,18 +897,180 @@ void transport_write_number( Transport *tpt, lua_Number x )
 
 //static void write_variable( Transport *tpt, lua_State *L, int var_index );
 //static int read_variable( Transport *tpt, lua_State *L );
+static void write_value( Transport *tpt, lua_State *L, int var_index );
+static int read_value( Transport *tpt, lua_State *L );
+
+// is the key at the given index one of 1..n?
+static int table_key_in_sequence( lua_State *L, int key_index, size_t n )
+{
+  lua_Number k;
+
+  if( n == 0 || lua_type( L, key_index ) != LUA_TNUMBER )
+    return 0;
+  k = lua_tonumber( L, key_index );
+  return k >= 1 && k <= n && k == ( lua_Number )( size_t )k;
+}
+
+// count the entries of a table with keys in 1..n and the others
+static void table_count( lua_State *L, int table_index, size_t n, size_t *narr, size_t *nrec )
+{
+  *narr = *nrec = 0;
+  lua_pushnil( L );
+  while( lua_next( L, table_index ) )
+  {
+    lua_pop( L, 1 );
+    if( table_key_in_sequence( L, -1, n ) )
+      ( *narr ) ++;
+    else
+      ( *nrec ) ++;
+  }
+}
+
+// numbers are packed this many at a time, converted in a block on the stack
+#define NUMARRAY_CHUNK ( 256 )
+
+// can numbers be packed as they are in memory? they can unless an integer
+// only end is involved, the byte order is fixed up for the whole block.
+static int numarray_native( Transport *tpt )
+{
+  return !tpt->net_intnum && !tpt->loc_intnum && tpt->lnum_bytes == sizeof( lua_Number );
+}
+
+// bytes a zigzag varint takes
+static size_t varint_size( int64_t x )
+{
+  uint64_t z = ( ( uint64_t )x << 1 ) ^ ( uint64_t )( x >> 63 );
+  size_t n = 1;
+
+  while( z >= 0x80 )
+  {
+    z >>= 7;
+    n ++;
+  }
+  return n;
+}
+
+// is the sequence part 1..n of the table all numbers, and no longer packed
+// than sent one by one? small integers are shorter as varints.
+static int table_is_numarray( Transport *tpt, lua_State *L, int table_index, size_t n )
+{
+  size_t i, packed = n * tpt->lnum_bytes, loose = 0;
+
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_Number x;
+
+    lua_rawgeti( L, table_index, i );
+    if( lua_type( L, -1 ) != LUA_TNUMBER )
+    {
+      lua_pop( L, 1 );
+      return 0;
+    }
+    x = lua_tonumber( L, -1 );
+    lua_pop( L, 1 );
+    if( ( tpt->options & RPC_OPT_VARINT ) && number_is_varint( x ) )
+      loose += 1 + varint_size( ( int64_t )x );
+    else
+      loose += 1 + tpt->lnum_bytes;
+  }
+  return packed <= loose;
+}
+
+// write the numbers 1..n of a table as one block of numbers in the
+// negotiated format
+static void write_numarray( Transport *tpt, lua_State *L, int table_index, size_t n )
+{
+  lua_Number block[ NUMARRAY_CHUNK ];
+  size_t i, j, k;
+
+  if( !numarray_native( tpt ) )
+  {
+    for( i = 1; i <= n; i ++ )
+    {
+      lua_rawgeti( L, table_index, i );
+      transport_write_number( tpt, lua_tonumber( L, -1 ) );
+      lua_pop( L, 1 );
+    }
+    return;
+  }
+
+  for( i = 1; i <= n; i += k )
+  {
+    k = n - i + 1 < NUMARRAY_CHUNK ? n - i + 1 : NUMARRAY_CHUNK;
+    for( j = 0; j < k; j ++ )
+    {
+      lua_rawgeti( L, table_index, i + j );
+      block[ j ] = lua_tonumber( L, -1 );
+      lua_pop( L, 1 );
+    }
+    if( tpt->net_little != tpt->loc_little )
+      bswap_block( block, k, sizeof( lua_Number ) );
+    transport_put( tpt, ( const u8 * )block, k * sizeof( lua_Number ) );
+  }
+}
 
 // write a table at the given index in the stack. the index must be absolute
-// (i.e. positive).
-// @@@ circular table references will cause stack overflow!
+// (i.e. positive). if the array option is on, the sequence part 1..n goes
+// first as a count and the bare values, the remaining entries follow as
+// key / value pairs. with the number array option a sequence of numbers is
+// sent as one packed block instead. with the table size option the number of
+// entries is counted first and sent ahead, so the reader can size the table
+// once.
+// @@@ without the table reference option circular table references will
+// cause stack overflow!
 static void write_table( Transport *tpt, lua_State *L, int table_index )
 {
+  size_t i, n = 0, narr = 0, nrec = 0;
+
+  luaL_checkstack( L, 4, "table nesting too deep" );
+  if( tpt->options & ( RPC_OPT_ARRAY | RPC_OPT_TABLESIZE ) )
+    n = lua_objlen( L, table_index );
+  if( tpt->options & RPC_OPT_TABLESIZE )
+    table_count( L, table_index, n, &narr, &nrec );
+
+  if( n > 0 && ( tpt->options & RPC_OPT_ARRAY ) )
+  {
+    int numarray = ( tpt->options & RPC_OPT_NUMARRAY ) &&
+                   table_is_numarray( tpt, L, table_index, n );
+
+    transport_write_u8( tpt, numarray ? RPC_NUMARRAY : RPC_ARRAY );
+    transport_write_uvarint( tpt, n );
+    if( tpt->options & RPC_OPT_TABLESIZE )
+      transport_write_uvarint( tpt, nrec );
+    if( numarray )
+      write_numarray( tpt, L, table_index, n );
+    else
+      for( i = 1; i <= n; i ++ )
+      {
+        lua_rawgeti( L, table_index, i );
+        write_value( tpt, L, lua_gettop( L ) );
+        lua_pop( L, 1 );
+      }
+  }
+  else
+  {
+    transport_write_u8( tpt, RPC_TABLE );
+    if( tpt->options & RPC_OPT_TABLESIZE )
+    {
+      transport_write_uvarint( tpt, narr );
+      transport_write_uvarint( tpt, nrec );
+    }
+    n = 0; // nothing to skip below
+  }
+
   lua_pushnil( L );  // push first key
   while ( lua_next( L, table_index ) ) 
   {
+    // skip what went out with the sequence part
+    if( table_key_in_sequence( L, -2, n ) )
+    {
+      lua_pop( L, 1 );
+      continue;
+    }
+
     // next key and value were pushed on the stack 
-    write_variable( tpt, L, lua_gettop( L ) - 1 );
-    write_variable( tpt, L, lua_gettop( L ) );
+    write_value( tpt, L, lua_gettop( L ) - 1 );
+    write_value( tpt, L, lua_gettop( L ) );
     
     // remove value, keep key for next iteration 
     lua_pop( L, 1 );
@@ -349,16 +1087,17 @@ static int writer( lua_State *L, const void* b, size_t size, void* B ) {
 #include "lundump.h"
 #include "ldo.h"
 
-// Dump bytecode representation of function onto stack and send. This
+// Dump bytecode representation of function onto stack. This
 // implementation uses eLua's crosscompile dump to match match the
-// bytecode representation to the client/server negotiated format.
-static void write_function( Transport *tpt, lua_State *L, int var_index )
+// bytecode representation to the client/server negotiated format. bytecode
+// is always in the byte order the peer reads, its loader can't convert.
+static void dump_function( Transport *tpt, lua_State *L, int var_index )
 {
   TValue *o;
   luaL_Buffer b;
   DumpTargetInfo target;
   
-  target.little_endian=tpt->net_little;
+  target.little_endian=tpt->rd_little;
   target.sizeof_int=sizeof(int);
   target.sizeof_strsize_t=sizeof(strsize_t);
   target.sizeof_lua_Number=tpt->lnum_bytes;
@@ -373,60 +1112,334 @@ static void write_function( Transport *tpt, lua_State *L, int var_index )
   luaU_dump_crosscompile(L,clvalue(o)->l.p,writer,&b,0,target);
   lua_unlock(L);
   
-  // put string representation on stack and send it
+  // put string representation on stack, remove function
   luaL_pushresult( &b );
-  write_variable( tpt, L, lua_gettop( L ) );
-  
-  // Remove function & dumped string from stack
-  lua_pop( L, 2 );
+  lua_remove( L, -2 );
 }
 #else
-static void write_function( Transport *tpt, lua_State *L, int var_index )
+// Dump bytecode representation of function onto stack. Dumps are kept in a
+// table with weak keys, a function sent again isn't dumped again.
+static void dump_function( Transport *tpt, lua_State *L, int var_index )
 {
   luaL_Buffer b;
+
+  lua_getfield( L, LUA_REGISTRYINDEX, "rpc.dumps" );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_newtable( L );
+    lua_pushliteral( L, "k" );
+    lua_setfield( L, -2, "__mode" );
+    lua_setmetatable( L, -2 );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, "rpc.dumps" );
+  }
+  lua_pushvalue( L, var_index );
+  lua_rawget( L, -2 );
+  if( lua_type( L, -1 ) == LUA_TSTRING )
+  {
+    lua_remove( L, -2 );
+    return;
+  }
+  lua_pop( L, 1 );
   
   // push function onto stack, serialize to string 
   lua_pushvalue( L, var_index );
   luaL_buffinit( L, &b );
   lua_dump(L, writer, &b);
   
-  // put string representation on stack and send it
+  // put string representation on stack, remove function, keep the dump
   luaL_pushresult( &b );
-  write_variable( tpt, L, lua_gettop( L ) );
-  
-  // Remove function & dumped string from stack
-  lua_pop( L, 2 );
+  lua_remove( L, -2 );
+  lua_pushvalue( L, var_index );
+  lua_pushvalue( L, -2 );
+  lua_rawset( L, -4 );
+  lua_remove( L, -2 );
 }
 #endif
 
+// hash of a function's bytecode (64 bit FNV-1a), it names the function in
+// the function caches of a session
+static uint64_t function_hash( const char *code, size_t len )
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for( i = 0; i < len; i ++ )
+  {
+    h ^= ( u8 )code[ i ];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// position of a hash in a most recent first list of functions, -1 if it
+// isn't there
+static int funcs_find( const uint64_t *list, u32 n, uint64_t hash )
+{
+  u32 i;
+
+  for( i = 0; i < n; i ++ )
+    if( list[ i ] == hash )
+      return ( int )i;
+  return -1;
+}
+
+// move the function at position i to the front of a list, or with i < 0 add
+// a new one there, dropping the least recently used one if the list is
+// full. slots, if given, are moved along and a new function gets a free slot
+// or the one of the dropped function.
+static void funcs_touch( uint64_t *list, u8 *slots, u32 *n, int i, uint64_t hash )
+{
+  u8 slot;
+
+  if( i < 0 )
+  {
+    if( *n < TRANSPORT_FUNC_CACHE )
+    {
+      if( slots )
+        slots[ *n ] = ( u8 )*n;
+      ( *n ) ++;
+    }
+    i = *n - 1;
+  }
+  slot = slots ? slots[ i ] : 0;
+  memmove( list + 1, list, i * sizeof( *list ) );
+  list[ 0 ] = hash;
+  if( slots )
+  {
+    memmove( slots + 1, slots, i );
+    slots[ 0 ] = slot;
+  }
+}
+
+static void transport_write_hash( Transport *tpt, uint64_t hash )
+{
+  transport_write_u32( tpt, ( u32 )( hash >> 32 ) );
+  transport_write_u32( tpt, ( u32 )hash );
+}
+
+static uint64_t transport_read_hash( Transport *tpt )
+{
+  uint64_t hash = ( uint64_t )transport_read_u32( tpt ) << 32;
+  return hash | transport_read_u32( tpt );
+}
+
+// send the function at the given index as its bytecode. with the function
+// cache option it goes with its hash, or as only the hash if the peer holds
+// it. both ends keep the same list of the functions the receiver holds.
+static void write_function( Transport *tpt, lua_State *L, int var_index )
+{
+  const char *code;
+  size_t len;
+  uint64_t hash;
+  int i;
+
+  dump_function( tpt, L, var_index );
+  if( !( tpt->options & RPC_OPT_FUNCCACHE ) )
+  {
+    transport_write_u8( tpt, RPC_FUNCTION );
+    write_value( tpt, L, lua_gettop( L ) );
+    transport_write_u8( tpt, RPC_FUNCTION_END );
+    lua_pop( L, 1 );
+    return;
+  }
+
+  code = lua_tolstring( L, -1, &len );
+  hash = function_hash( code, len );
+  i = funcs_find( tpt->funcs_sent, tpt->funcs_sent_count, hash );
+  funcs_touch( tpt->funcs_sent, NULL, &tpt->funcs_sent_count, i, hash );
+  if( i >= 0 )
+  {
+    transport_write_u8( tpt, RPC_FUNCREF );
+    transport_write_hash( tpt, hash );
+  }
+  else
+  {
+    transport_write_u8( tpt, RPC_FUNCTION );
+    transport_write_hash( tpt, hash );
+    write_value( tpt, L, lua_gettop( L ) );
+    transport_write_u8( tpt, RPC_FUNCTION_END );
+  }
+  lua_pop( L, 1 );
+}
+
+// look the string or table at the given index up in the reference table of
+// the value being written. a repeat is sent as a reference with the given
+// tag and 1 is returned, anything new gets the next number and 0 is returned
+// (it is then sent in full).
+static int write_ref( Transport *tpt, lua_State *L, int var_index, u8 tag )
+{
+  lua_pushvalue( L, var_index );
+  lua_rawget( L, tpt->refs_index );
+  if( lua_type( L, -1 ) == LUA_TNUMBER )
+  {
+    transport_write_u8( tpt, tag );
+    transport_write_uvarint( tpt, ( uint64_t )lua_tonumber( L, -1 ) );
+    lua_pop( L, 1 );
+    return 1;
+  }
+  lua_pop( L, 1 );
+  lua_pushvalue( L, var_index );
+  lua_pushnumber( L, tpt->refs_count ++ );
+  lua_rawset( L, tpt->refs_index );
+  return 0;
+}
+
+// write a value that is sent on its own. with the string or table reference
+// options a table is written with a reference table of its own, kept on the
+// stack while the table is traversed.
+static void write_root( Transport *tpt, lua_State *L, int var_index )
+{
+  tpt->refs_index = 0;
+  if( ( tpt->options & RPC_OPT_REFS ) && lua_type( L, var_index ) == LUA_TTABLE )
+  {
+    lua_newtable( L );
+    tpt->refs_index = lua_gettop( L );
+    tpt->refs_count = 0;
+    write_value( tpt, L, var_index );
+    lua_pop( L, 1 );
+    tpt->refs_index = 0;
+    return;
+  }
+  write_value( tpt, L, var_index );
+}
+
+// encode a value into zbuf, and compress it into scratch if it is large
+// enough and gets at least an eighth smaller. returns the compressed length,
+// or 0 if the value goes as it is.
+static u32 compress_value( Transport *tpt, lua_State *L, int var_index )
+{
+  u32 raw;
+
+  tpt->zbuf_len = 0;
+  tpt->capture = 1;
+  write_root( tpt, L, var_index );
+  tpt->capture = 0;
+
+  raw = tpt->zbuf_len;
+  if( raw < TRANSPORT_COMPRESS_MIN )
+    return 0;
+  return lzf_compress( tpt->zbuf, raw, transport_scratch_reserve( tpt, raw ), raw - raw / 8 );
+}
+
+// write a value compressed by compress_value
+static void write_packed( Transport *tpt, u32 raw, u32 packed )
+{
+  transport_write_u8( tpt, RPC_COMPRESSED );
+  transport_write_uvarint( tpt, raw );
+  transport_write_uvarint( tpt, packed );
+  transport_put( tpt, ( const u8 * )tpt->scratch, packed );
+}
+
+// send a value compressed, or as it is if that doesn't pay
+static void write_compressed( Transport *tpt, lua_State *L, int var_index )
+{
+  u32 packed = compress_value( tpt, L, var_index );
+
+  if( packed != 0 )
+    write_packed( tpt, tpt->zbuf_len, packed );
+  else
+    transport_put( tpt, tpt->zbuf, tpt->zbuf_len );
+
+  if( tpt->scratch_size > TRANSPORT_SCRATCH_KEEP )
+    transport_scratch_free( tpt );
+  if( tpt->zbuf_size > TRANSPORT_SCRATCH_KEEP )
+    transport_zbuf_free( tpt );
+}
+
+// with the compression option tables and long strings are encoded in memory
+// first, to be compressed
+static int value_compressible( Transport *tpt, lua_State *L, int var_index )
+{
+  int type = lua_type( L, var_index );
+
+  return ( tpt->options & RPC_OPT_COMPRESS ) &&
+         ( type == LUA_TTABLE ||
+           ( type == LUA_TSTRING && lua_objlen( L, var_index ) >= TRANSPORT_COMPRESS_MIN ) );
+}
+
 // write a variable at the given index in the stack. the index must be absolute
 // (i.e. positive).
-
 void write_variable( Transport *tpt, lua_State *L, int var_index )
+{
+  if( value_compressible( tpt, L, var_index ) )
+    write_compressed( tpt, L, var_index );
+  else
+    write_root( tpt, L, var_index );
+}
+
+// encode the value at the given index into zbuf (zbuf_len bytes), the same
+// bytes write_variable would send. the index must be absolute.
+void transport_encode( Transport *tpt, lua_State *L, int var_index )
+{
+  u32 raw, packed;
+
+  if( !value_compressible( tpt, L, var_index ) )
+  {
+    tpt->zbuf_len = 0;
+    tpt->capture = 1;
+    write_root( tpt, L, var_index );
+    tpt->capture = 0;
+    return;
+  }
+
+  // the compressed form replaces the encoding
+  packed = compress_value( tpt, L, var_index );
+  if( packed != 0 )
+  {
+    raw = tpt->zbuf_len;
+    tpt->zbuf_len = 0;
+    tpt->capture = 1;
+    write_packed( tpt, raw, packed );
+    tpt->capture = 0;
+  }
+}
+
+static void write_value( Transport *tpt, lua_State *L, int var_index )
 {
 //  int stack_at_start = lua_gettop( L );
   
   switch( lua_type( L, var_index ) )
   {
     case LUA_TNUMBER:
-      transport_write_u8( tpt, RPC_NUMBER );
-      transport_write_number( tpt, lua_tonumber( L, var_index ) );
+    {
+      lua_Number x = lua_tonumber( L, var_index );
+      if( ( tpt->options & RPC_OPT_VARINT ) && number_is_varint( x ) )
+      {
+        transport_write_u8( tpt, RPC_INTEGER );
+        transport_write_varint( tpt, ( int64_t )x );
+      }
+      else
+      {
+        transport_write_u8( tpt, RPC_NUMBER );
+        transport_write_number( tpt, x );
+      }
       break;
+    }
 
     case LUA_TSTRING:
     {
       const char *s;
       u32 len;
-      transport_write_u8( tpt, RPC_STRING );
       s = lua_tostring( L, var_index );
       len = lua_strlen( L, var_index );
-      transport_write_u32( tpt, len );
-      transport_write_string( tpt, s, len );
+      if( tpt->refs_index != 0 && ( tpt->options & RPC_OPT_STRREF ) && len >= RPC_STRREF_MIN &&
+          write_ref( tpt, L, var_index, RPC_STRREF ) )
+        break;
+      transport_write_string_tag( tpt, len );
+      if( len >= TRANSPORT_WREF_MIN )
+        transport_put_ref( tpt, L, var_index, ( const u8 * )s, len );
+      else
+        transport_write_string( tpt, s, len );
       break;
     }
 
     case LUA_TTABLE:
-      transport_write_u8( tpt, RPC_TABLE );
+      if( tpt->refs_index != 0 && ( tpt->options & RPC_OPT_TABLEREF ) &&
+          write_ref( tpt, L, var_index, RPC_TABLEREF ) )
+        break;
       write_table( tpt, L, var_index );
       transport_write_u8( tpt, RPC_TABLE_END );
       break;
@@ -441,9 +1454,7 @@ void write_variable( Transport *tpt, lua_State *L, int var_index )
       break;
 
     case LUA_TFUNCTION:
-      transport_write_u8( tpt, RPC_FUNCTION );
       write_function( tpt, L, var_index );
-      transport_write_u8( tpt, RPC_FUNCTION_END );
       break;
 
     case LUA_TUSERDATA:
@@ -451,7 +1462,26 @@ void write_variable( Transport *tpt, lua_State *L, int var_index )
       {
         transport_write_u8( tpt, RPC_REMOTE );
         helper_remote_index( ( Helper * )lua_touserdata( L, var_index ) );        
-      } else
+      }
+#ifdef LUARPC_ENABLE_FILE
+      else if( lua_isuserdata( L, var_index ) && ismetatable_type( L, var_index, "rpc.file" ) )
+      {
+        File *f = ( File * )lua_touserdata( L, var_index );
+        struct exception e;
+        // earlier parts of the message may have gone out with a file
+        // already, so the link can't be trusted afterwards
+        if( f->fd < 0 )
+        {
+          e.errnum = EBADF;
+          e.type = fatal;
+          Throw( e );
+        }
+        transport_write_u8( tpt, RPC_FILE );
+        transport_write_u32( tpt, f->length );
+        transport_write_file( tpt, f );
+      }
+#endif
+      else
         luaL_error( L, "userdata transmission unsupported" );
       break;
 
@@ -468,50 +1498,278 @@ void write_variable( Transport *tpt, lua_State *L, int var_index )
 
 
 // read a table and push in onto the stack 
-static void read_table( Transport *tpt, lua_State *L )
+static void read_table_pairs( Transport *tpt, lua_State *L, int table_index )
 {
-  int table_index;
-  lua_newtable( L );
-  table_index = lua_gettop( L );
+  struct exception e;
+
   for ( ;; ) 
   {
-    if( !read_variable( tpt, L ) )
+    if( !read_value( tpt, L ) )
       return;
-    read_variable( tpt, L );
+    // a key has to be followed by a value and lua won't take nil or nan
+    // keys, any of that is garbage
+    if( !read_value( tpt, L ) || lua_isnil( L, -2 ) ||
+        ( lua_type( L, -2 ) == LUA_TNUMBER && lua_tonumber( L, -2 ) != lua_tonumber( L, -2 ) ) )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = fatal;
+      Throw( e );
+    }
     lua_rawset( L, table_index );
   }
 }
 
+// number the string or table at the top of the stack in the reference table
+// of the value being read
+static void read_ref_add( Transport *tpt, lua_State *L )
+{
+  lua_pushvalue( L, -1 );
+  lua_rawseti( L, tpt->refs_index, ++ tpt->refs_count );
+}
+
+// size hints from the peer are only followed up to this many entries, a
+// garbled hint can't make the reader allocate a huge table
+#define TABLE_PRESIZE_MAX ( 1 << 20 )
+
+static int table_presize( uint64_t n )
+{
+  return n < TABLE_PRESIZE_MAX ? ( int )n : TABLE_PRESIZE_MAX;
+}
+
+// make room on the lua stack for a table being read and an entry of it, the
+// room grows with each level of nesting. nesting deeper than lua allows is
+// taken for garbage.
+static void read_table_room( lua_State *L )
+{
+  struct exception e;
+
+  if( !lua_checkstack( L, 4 ) )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+}
+
+static void read_table( Transport *tpt, lua_State *L )
+{
+  read_table_room( L );
+  if( tpt->options & RPC_OPT_TABLESIZE )
+  {
+    uint64_t narr = transport_read_uvarint( tpt );
+    lua_createtable( L, table_presize( narr ), table_presize( transport_read_uvarint( tpt ) ) );
+  }
+  else
+    lua_newtable( L );
+  if( tpt->refs_index != 0 && ( tpt->options & RPC_OPT_TABLEREF ) )
+    read_ref_add( tpt, L );
+  read_table_pairs( tpt, L, lua_gettop( L ) );
+}
+
+// read the numbers 1..n of a table, sent as one block
+static void read_numarray( Transport *tpt, lua_State *L, int table_index, int n )
+{
+  lua_Number block[ NUMARRAY_CHUNK ];
+  int i, j, k;
+
+  if( !numarray_native( tpt ) )
+  {
+    for( i = 1; i <= n; i ++ )
+    {
+      lua_pushnumber( L, transport_read_number( tpt ) );
+      lua_rawseti( L, table_index, i );
+    }
+    return;
+  }
+
+  for( i = 1; i <= n; i += k )
+  {
+    k = n - i + 1 < NUMARRAY_CHUNK ? n - i + 1 : NUMARRAY_CHUNK;
+    transport_get( tpt, ( u8 * )block, k * sizeof( lua_Number ) );
+    if( tpt->rd_little != tpt->loc_little )
+      bswap_block( block, k, sizeof( lua_Number ) );
+    for( j = 0; j < k; j ++ )
+    {
+      lua_pushnumber( L, block[ j ] );
+      lua_rawseti( L, table_index, i + j );
+    }
+  }
+}
+
+// read a table that starts with its sequence part, the table is created
+// with room for it and filled in order. the sequence part is a block of
+// numbers if numarray is set.
+static void read_array( Transport *tpt, lua_State *L, int numarray )
+{
+  struct exception e;
+  uint64_t i, n = transport_read_uvarint( tpt );
+  uint64_t nrec = 0;
+  int table_index;
+
+  read_table_room( L );
+  if( n > MAXINT )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+  if( tpt->options & RPC_OPT_TABLESIZE )
+    nrec = transport_read_uvarint( tpt );
+
+  lua_createtable( L, table_presize( n ), table_presize( nrec ) );
+  if( tpt->refs_index != 0 && ( tpt->options & RPC_OPT_TABLEREF ) )
+    read_ref_add( tpt, L );
+  table_index = lua_gettop( L );
+  if( numarray )
+    read_numarray( tpt, L, table_index, ( int )n );
+  else
+    for( i = 1; i <= n; i ++ )
+    {
+      if( !read_value( tpt, L ) )
+      {
+        e.errnum = ERR_PROTOCOL;
+        e.type = fatal;
+        Throw( e );
+      }
+      lua_rawseti( L, table_index, ( int )i );
+    }
+  read_table_pairs( tpt, L, table_index );
+}
+
 // read function and load
 static void read_function( Transport *tpt, lua_State *L )
 {
+  struct exception e;
   const char *b;
   size_t len;
   
-  for( ;; )
+  // the code comes as one string
+  if( !read_value( tpt, L ) || lua_type( L, -1 ) != LUA_TSTRING ||
+      read_value( tpt, L ) )
   {
-    if( !read_variable( tpt, L ) )
-      return;
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+
+  b = lua_tolstring( L, -1, &len );
+  luaL_loadbuffer( L, b, len, b );
+  lua_remove( L, -2 );
+}
 
-    b = luaL_checklstring( L, -1, &len );
-    luaL_loadbuffer( L, b, len, b );
-    lua_insert( L, -2 );
+// push the table holding the functions received in the session, function
+// and code of slot i at i + 1 and i + 1 + TRANSPORT_FUNC_CACHE
+static void funcs_push( Transport *tpt, lua_State *L )
+{
+  if( tpt->funcs_ref == LUA_NOREF )
+  {
+    lua_createtable( L, 2 * TRANSPORT_FUNC_CACHE, 0 );
+    tpt->funcs_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->funcs_ref );
+}
+
+// load the code at the top of the stack, replacing it with the function (or
+// the error message). a function without upvalues is kept in slot i and
+// handed out again, others are loaded from the code each time, so closures
+// never share upvalues.
+static void funcs_load( Transport *tpt, lua_State *L, int slot )
+{
+  const char *code;
+  size_t len;
+  int keep;
+
+  code = lua_tolstring( L, -1, &len );
+  keep = luaL_loadbuffer( L, code, len, code ) == 0;
+  if( keep && lua_getupvalue( L, -1, 1 ) != NULL )
+  {
     lua_pop( L, 1 );
+    keep = 0;
   }
+  lua_remove( L, -2 );
+
+  funcs_push( tpt, L );
+  if( keep )
+    lua_pushvalue( L, -2 );
+  else
+    lua_pushnil( L );
+  lua_rawseti( L, -2, slot + 1 );
+  lua_pop( L, 1 );
+}
+
+// read a function sent with its hash, and keep it as the most recently
+// used one. the sender counts on it being held until the cache is full.
+static void read_function_cached( Transport *tpt, lua_State *L )
+{
+  struct exception e;
+  uint64_t hash = transport_read_hash( tpt );
+  int slot;
+
+  if( !read_value( tpt, L ) || lua_type( L, -1 ) != LUA_TSTRING ||
+      read_value( tpt, L ) )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+
+  funcs_touch( tpt->funcs_hash, tpt->funcs_slot, &tpt->funcs_count,
+               funcs_find( tpt->funcs_hash, tpt->funcs_count, hash ), hash );
+  slot = tpt->funcs_slot[ 0 ];
+  funcs_push( tpt, L );
+  lua_pushvalue( L, -2 );
+  lua_rawseti( L, -2, slot + 1 + TRANSPORT_FUNC_CACHE );
+  lua_pop( L, 1 );
+  funcs_load( tpt, L, slot );
+}
+
+// push a function the peer sent before, by its hash
+static void read_funcref( Transport *tpt, lua_State *L )
+{
+  struct exception e;
+  uint64_t hash = transport_read_hash( tpt );
+  int i = funcs_find( tpt->funcs_hash, tpt->funcs_count, hash );
+  int slot;
+
+  if( i < 0 )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+  funcs_touch( tpt->funcs_hash, tpt->funcs_slot, &tpt->funcs_count, i, hash );
+  slot = tpt->funcs_slot[ 0 ];
+
+  funcs_push( tpt, L );
+  lua_rawgeti( L, -1, slot + 1 );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    lua_rawgeti( L, -1, slot + 1 + TRANSPORT_FUNC_CACHE );
+    lua_remove( L, -2 );
+    funcs_load( tpt, L, slot );
+    return;
+  }
+  lua_remove( L, -2 );
 }
 
 static void read_index( Transport *tpt, lua_State *L )
 {
+  struct exception e;
   u32 len;
   char *funcname;
   char *token = NULL;
   
   len = transport_read_u32( tpt ); // variable name length
-  funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
+  funcname = transport_read_scratch( tpt, len );
   
   token = strtok( funcname, "." );
+  if( token == NULL )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
   lua_getglobal( L, token );
   token = strtok( NULL, "." );
   while( token != NULL )
@@ -523,14 +1781,170 @@ static void read_index( Transport *tpt, lua_State *L )
 }
 
 
+// read a string and push it, numbering it if the writer did so
+static void read_string( Transport *tpt, lua_State *L, u32 length )
+{
+  transport_push_string( tpt, L, length );
+  if( tpt->refs_index != 0 && ( tpt->options & RPC_OPT_STRREF ) && length >= RPC_STRREF_MIN )
+    read_ref_add( tpt, L );
+}
+
+// push a string or table (as given by type) that was read earlier in the
+// same value
+static void read_ref( Transport *tpt, lua_State *L, int type )
+{
+  struct exception e;
+  uint64_t i = transport_read_uvarint( tpt );
+
+  if( tpt->refs_index != 0 && i < tpt->refs_count )
+  {
+    lua_rawgeti( L, tpt->refs_index, ( int )i + 1 );
+    if( lua_type( L, -1 ) == type )
+      return;
+  }
+  e.errnum = ERR_PROTOCOL;
+  e.type = fatal;
+  Throw( e );
+}
+
+static int read_tagged( Transport *tpt, lua_State *L, u8 type );
+
+// read a compressed value. it is decompressed into zbuf and decoded from
+// there in place of the read-ahead buffer, which is put back afterwards.
+static void read_compressed( Transport *tpt, lua_State *L )
+{
+  struct exception e;
+  uint64_t raw = transport_read_uvarint( tpt );
+  uint64_t packed = transport_read_uvarint( tpt );
+  const char *in;
+  u8 *buf;
+  u32 pos, len;
+
+  // values don't nest, and lzf makes at most 88 bytes out of one
+  if( tpt->rbuf == tpt->zbuf || packed == 0 || packed >= raw || raw > MAXINT ||
+      raw > packed * 88 )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+
+  in = transport_read_scratch( tpt, ( u32 )packed );
+  transport_zbuf_reserve( tpt, ( u32 )raw );
+  if( lzf_decompress( in, ( u32 )packed, tpt->zbuf, ( u32 )raw ) != raw )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+  tpt->zbuf_len = ( u32 )raw;
+
+  buf = tpt->rbuf;
+  pos = tpt->rbuf_pos;
+  len = tpt->rbuf_len;
+  tpt->rbuf = tpt->zbuf;
+  tpt->rbuf_pos = 0;
+  tpt->rbuf_len = tpt->zbuf_len;
+  Try
+  {
+    // the value has to use up all of the decompressed bytes
+    if( !read_variable( tpt, L ) || tpt->rbuf_pos != tpt->rbuf_len )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = fatal;
+      Throw( e );
+    }
+  }
+  Catch( e )
+  {
+    tpt->rbuf = buf;
+    tpt->rbuf_pos = pos;
+    tpt->rbuf_len = len;
+    Throw( e );
+  }
+  tpt->rbuf = buf;
+  tpt->rbuf_pos = pos;
+  tpt->rbuf_len = len;
+
+  if( tpt->scratch_size > TRANSPORT_SCRATCH_KEEP )
+    transport_scratch_free( tpt );
+  if( tpt->zbuf_size > TRANSPORT_SCRATCH_KEEP )
+    transport_zbuf_free( tpt );
+}
+
 // read a variable and push in onto the stack. this returns 1 if a "normal"
 // variable was read, or 0 if an end-table or end-function marker was read (in which case
-// nothing is pushed onto the stack).
+// nothing is pushed onto the stack). with the string or table reference
+// options a table comes with a reference table of its own, kept on the stack
+// below it while it is read.
 int read_variable( Transport *tpt, lua_State *L )
 {
-  struct exception e;
   u8 type = transport_read_u8( tpt );
 
+  if( type == RPC_COMPRESSED && ( tpt->options & RPC_OPT_COMPRESS ) )
+  {
+    read_compressed( tpt, L );
+    return 1;
+  }
+
+  tpt->refs_index = 0;
+  if( ( tpt->options & RPC_OPT_REFS ) && ( type == RPC_TABLE || type == RPC_ARRAY || type == RPC_NUMARRAY ) )
+  {
+    lua_newtable( L );
+    tpt->refs_index = lua_gettop( L );
+    tpt->refs_count = 0;
+    read_tagged( tpt, L, type );
+    lua_remove( L, tpt->refs_index );
+    tpt->refs_index = 0;
+    return 1;
+  }
+  return read_tagged( tpt, L, type );
+}
+
+// decode the value held in buffer and push it, the buffer must hold all of
+// it and nothing more
+void transport_decode( Transport *tpt, lua_State *L, const u8 *buffer, u32 length )
+{
+  struct exception e;
+
+  tpt->rbuf = ( u8 * )buffer;
+  tpt->rbuf_pos = 0;
+  tpt->rbuf_len = length;
+  Try
+  {
+    if( !read_variable( tpt, L ) || tpt->rbuf_pos != tpt->rbuf_len )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = fatal;
+      Throw( e );
+    }
+  }
+  Catch( e )
+  {
+    tpt->rbuf = tpt->rbuf_mem;
+    tpt->rbuf_pos = tpt->rbuf_len = 0;
+    Throw( e );
+  }
+  tpt->rbuf = tpt->rbuf_mem;
+  tpt->rbuf_pos = tpt->rbuf_len = 0;
+}
+
+static int read_value( Transport *tpt, lua_State *L )
+{
+  return read_tagged( tpt, L, transport_read_u8( tpt ) );
+}
+
+// read a variable of the given type
+static int read_tagged( Transport *tpt, lua_State *L, u8 type )
+{
+  struct exception e;
+
+  if( type >= RPC_SHORT_STRING && type <= RPC_SHORT_STRING + RPC_SHORT_STRING_MAX )
+  {
+    read_string( tpt, L, type - RPC_SHORT_STRING );
+    return 1;
+  }
+
   switch( type )
   {
     case RPC_NIL:
@@ -545,25 +1959,54 @@ int read_variable( Transport *tpt, lua_State *L )
       lua_pushnumber( L, transport_read_number( tpt ) );
       break;
 
+    case RPC_INTEGER:
+      lua_pushnumber( L, ( lua_Number )transport_read_varint( tpt ) );
+      break;
+
     case RPC_STRING:
-    {
-      u32 len = transport_read_u32( tpt );
-      char *s = ( char * )alloca( len + 1 );
-      transport_read_string( tpt, s, len );
-      s[ len ] = 0;
-      lua_pushlstring( L, s, len );
+      read_string( tpt, L, transport_read_u32( tpt ) );
+      break;
+
+    case RPC_STRING8:
+      read_string( tpt, L, transport_read_u8( tpt ) );
+      break;
+
+    case RPC_STRING16:
+      read_string( tpt, L, transport_read_u16( tpt ) );
+      break;
+
+    case RPC_STRREF:
+      read_ref( tpt, L, LUA_TSTRING );
+      break;
+
+    case RPC_TABLEREF:
+      read_ref( tpt, L, LUA_TTABLE );
       break;
-    }
 
     case RPC_TABLE:
       read_table( tpt, L );
       break;
 
+    case RPC_ARRAY:
+      read_array( tpt, L, 0 );
+      break;
+
+    case RPC_NUMARRAY:
+      read_array( tpt, L, 1 );
+      break;
+
     case RPC_TABLE_END:
       return 0;
 
     case RPC_FUNCTION:
-      read_function( tpt, L );
+      if( tpt->options & RPC_OPT_FUNCCACHE )
+        read_function_cached( tpt, L );
+      else
+        read_function( tpt, L );
+      break;
+
+    case RPC_FUNCREF:
+      read_funcref( tpt, L );
       break;
     
     case RPC_FUNCTION_END:
@@ -573,16 +2016,433 @@ int read_variable( Transport *tpt, lua_State *L )
       read_index( tpt, L );
       break;
 
+    // without file support the payload is handed over as a string
+    case RPC_FILE:
+#ifdef LUARPC_ENABLE_FILE
+      transport_read_file( tpt, L, transport_read_u32( tpt ) );
+#else
+      transport_push_string( tpt, L, transport_read_u32( tpt ) );
+#endif
+      break;
+
     default:
-      e.errnum = type;
+      e.errnum = ERR_PROTOCOL;
       e.type = fatal;
       Throw( e );
   }
   return 1;
 }
 
-void transport_set_mode(Transport *tpt, int mode)
+// **************************************************************************
+// resumable scanning
+//   a command is scanned as it arrives to find its end, so it can be decoded
+//   from memory once all of it is there. the scan follows what the read
+//   functions above would read, but keeps the parts of the command still to
+//   come on a stack of its own instead of recursing, and only ever takes a
+//   whole tag with its lengths: when the bytes run out it stops and picks up
+//   at the same place once more have been added. the contents of strings and
+//   blocks are passed over as they come. file payloads are handed to the
+//   caller, which takes them out of the bytes of the command as they come.
+
+void transport_scan_init( TransportScan *s )
+{
+  s->pos = 0;
+  s->skip = 0;
+  s->depth = 0;
+  s->size = 0;
+  s->stack = NULL;
+  s->file = 0;
+  s->file_left = 0;
+}
+
+// start over for the next command, keeping the stack's memory
+void transport_scan_reset( TransportScan *s )
+{
+  s->pos = 0;
+  s->skip = 0;
+  s->depth = 0;
+  s->file = 0;
+  s->file_left = 0;
+}
+
+void transport_scan_free( TransportScan *s )
 {
-printf("transport switched to mode %d\n",mode);
-    tpt->mode=mode;
+  free( s->stack );
+  transport_scan_init( s );
+}
+
+// add a part to come before those on the stack, parts of a command are
+// pushed last one first
+void transport_scan_push( TransportScan *s, int item, uint64_t count )
+{
+  struct exception e;
+
+  if( s->depth == s->size )
+  {
+    TransportScanItem *p = NULL;
+    int size = s->size ? s->size * 2 : 16;
+
+    // nesting lua couldn't decode anyway is garbage
+    if( s->size >= TRANSPORT_SCAN_DEPTH )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = fatal;
+      Throw( e );
+    }
+    p = ( TransportScanItem * )realloc( s->stack, size * sizeof( TransportScanItem ) );
+    if( p == NULL )
+    {
+      e.errnum = ENOMEM;
+      e.type = fatal;
+      Throw( e );
+    }
+    s->stack = p;
+    s->size = size;
+  }
+  s->stack[ s->depth ].item = item;
+  s->stack[ s->depth ].count = count;
+  s->depth ++;
+}
+
+// take a varint at *pos, if all of it is there
+static int scan_uvarint( const u8 *b, u32 len, u32 *pos, uint64_t *x )
+{
+  struct exception e;
+  uint64_t z = 0;
+  int shift = 0;
+  u32 i = *pos;
+
+  do
+  {
+    if( i >= len )
+      return 0;
+    if( shift > 63 )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = fatal;
+      Throw( e );
+    }
+    z |= ( uint64_t )( b[ i ] & 0x7f ) << shift;
+    shift += 7;
+  } while( b[ i ++ ] & 0x80 );
+
+  *pos = i;
+  *x = z;
+  return 1;
+}
+
+// take an unsigned integer of size bytes in the read byte order at *pos, if
+// all of it is there
+static int scan_uint( Transport *tpt, const u8 *b, u32 len, u32 *pos, int size, u32 *x )
+{
+  u32 z = 0;
+  int i;
+
+  if( len - *pos < ( u32 )size )
+    return 0;
+  for( i = 0; i < size; i ++ )
+    z |= ( u32 )b[ *pos + i ] << ( 8 * ( tpt->rd_little ? i : size - 1 - i ) );
+  *pos += size;
+  *x = z;
+  return 1;
+}
+
+// take the tag of a value at s->pos with the lengths following it, as
+// read_variable (if var is set) or read_value would. returns 1 for a value,
+// 0 for an end marker and -1 if the bytes run out first, nothing is taken
+// then. contents to pass over go to skip, parts of tables and functions on
+// the stack.
+static int scan_value( Transport *tpt, TransportScan *s, const u8 *b, u32 len, int var )
+{
+  struct exception e;
+  u32 pos = s->pos + 1, n;
+  uint64_t x, y;
+  u8 type;
+
+  if( s->pos >= len )
+    return -1;
+  type = b[ s->pos ];
+
+  if( type >= RPC_SHORT_STRING && type <= RPC_SHORT_STRING + RPC_SHORT_STRING_MAX )
+  {
+    s->skip = type - RPC_SHORT_STRING;
+    s->pos = pos;
+    return 1;
+  }
+
+  switch( type )
+  {
+    case RPC_NIL:
+      break;
+
+    case RPC_BOOLEAN:
+      s->skip = 1;
+      break;
+
+    case RPC_NUMBER:
+      s->skip = tpt->lnum_bytes;
+      break;
+
+    case RPC_INTEGER:
+    case RPC_STRREF:
+    case RPC_TABLEREF:
+      if( !scan_uvarint( b, len, &pos, &x ) )
+        return -1;
+      break;
+
+    case RPC_STRING:
+    case RPC_REMOTE:
+      if( !scan_uint( tpt, b, len, &pos, 4, &n ) )
+        return -1;
+      s->skip = n;
+      break;
+
+    case RPC_STRING8:
+      if( !scan_uint( tpt, b, len, &pos, 1, &n ) )
+        return -1;
+      s->skip = n;
+      break;
+
+    case RPC_STRING16:
+      if( !scan_uint( tpt, b, len, &pos, 2, &n ) )
+        return -1;
+      s->skip = n;
+      break;
+
+    case RPC_TABLE:
+      if( ( tpt->options & RPC_OPT_TABLESIZE ) &&
+          ( !scan_uvarint( b, len, &pos, &x ) || !scan_uvarint( b, len, &pos, &y ) ) )
+        return -1;
+      transport_scan_push( s, TRANSPORT_SCAN_PAIRS, 0 );
+      break;
+
+    case RPC_ARRAY:
+    case RPC_NUMARRAY:
+      if( !scan_uvarint( b, len, &pos, &x ) ||
+          ( ( tpt->options & RPC_OPT_TABLESIZE ) && !scan_uvarint( b, len, &pos, &y ) ) )
+        return -1;
+      if( x > MAXINT )
+      {
+        e.errnum = ERR_PROTOCOL;
+        e.type = fatal;
+        Throw( e );
+      }
+      transport_scan_push( s, TRANSPORT_SCAN_PAIRS, 0 );
+      if( type == RPC_ARRAY )
+        transport_scan_push( s, TRANSPORT_SCAN_ELEMENTS, x );
+      else
+        s->skip = x * tpt->lnum_bytes;
+      break;
+
+    case RPC_TABLE_END:
+    case RPC_FUNCTION_END:
+      s->pos = pos;
+      return 0;
+
+    case RPC_FUNCTION:
+      if( tpt->options & RPC_OPT_FUNCCACHE )
+        s->skip = 8;
+      transport_scan_push( s, TRANSPORT_SCAN_BODY, 0 );
+      break;
+
+    case RPC_FUNCREF:
+      s->skip = 8;
+      break;
+
+    // without file support the payload is read as a string
+    case RPC_FILE:
+      if( !scan_uint( tpt, b, len, &pos, 4, &n ) )
+        return -1;
+#ifdef LUARPC_ENABLE_FILE
+      s->file = 1;
+      s->file_left = n;
+#else
+      s->skip = n;
+#endif
+      break;
+
+    case RPC_COMPRESSED:
+      if( var && ( tpt->options & RPC_OPT_COMPRESS ) )
+      {
+        if( !scan_uvarint( b, len, &pos, &x ) || !scan_uvarint( b, len, &pos, &y ) )
+          return -1;
+        s->skip = y;
+        break;
+      }
+      // fall through
+
+    default:
+      e.errnum = ERR_PROTOCOL;
+      e.type = fatal;
+      Throw( e );
+  }
+  s->pos = pos;
+  return 1;
+}
+
+// go on scanning the command held in the first length bytes of buffer.
+// returns 1 once all of it is there, s->pos is then its length, or once a
+// file payload is reached. file is set then, the caller takes the payload's
+// bytes starting at s->pos out of the buffer and clears file to go on.
+// returns 0 if more is needed, the next call must come with the same bytes
+// and those that arrived since.
+int transport_scan( Transport *tpt, TransportScan *s, const u8 *buffer, u32 length )
+{
+  struct exception e;
+  uint64_t x;
+  u32 n;
+  int i, r;
+
+  while( !s->file )
+  {
+    if( s->skip > 0 )
+    {
+      n = length - s->pos;
+      if( s->skip < n )
+        n = ( u32 )s->skip;
+      s->pos += n;
+      s->skip -= n;
+      if( s->skip > 0 )
+        return 0;
+    }
+    if( s->depth == 0 )
+      return 1;
+
+    i = s->depth - 1;
+    switch( s->stack[ i ].item )
+    {
+      case TRANSPORT_SCAN_BYTES:
+        s->skip = s->stack[ i ].count;
+        s->depth --;
+        break;
+
+      case TRANSPORT_SCAN_STRING:
+        if( !scan_uint( tpt, buffer, length, &s->pos, 4, &n ) )
+          return 0;
+        s->skip = n;
+        s->depth --;
+        break;
+
+      case TRANSPORT_SCAN_HEADER:
+        if( length - s->pos < RPC_HEADER_BASE_SIZE )
+          return 0;
+        if( buffer[ s->pos + 4 ] >= RPC_PROTOCOL_VERSION_OPTIONS )
+          s->skip = RPC_HEADER_SIZE;
+        else
+          s->skip = RPC_HEADER_BASE_SIZE;
+        s->depth --;
+        break;
+
+      case TRANSPORT_SCAN_UVARINT:
+        if( !scan_uvarint( buffer, length, &s->pos, &x ) )
+          return 0;
+        s->depth --;
+        break;
+
+      case TRANSPORT_SCAN_ARGS:
+        if( !scan_uint( tpt, buffer, length, &s->pos, 4, &n ) )
+          return 0;
+        s->stack[ i ].item = TRANSPORT_SCAN_VARS;
+        s->stack[ i ].count = n;
+        break;
+
+      // a value ends a part only after its own parts, which go on top
+      case TRANSPORT_SCAN_VARS:
+      case TRANSPORT_SCAN_ELEMENTS:
+        if( s->stack[ i ].count == 0 )
+        {
+          s->depth --;
+          break;
+        }
+        r = scan_value( tpt, s, buffer, length, s->stack[ i ].item == TRANSPORT_SCAN_VARS );
+        if( r < 0 )
+          return 0;
+        if( r == 0 && s->stack[ i ].item == TRANSPORT_SCAN_ELEMENTS )
+        {
+          e.errnum = ERR_PROTOCOL;
+          e.type = fatal;
+          Throw( e );
+        }
+        s->stack[ i ].count --;
+        break;
+
+      // count is 1 after a key, the end only comes in its place
+      case TRANSPORT_SCAN_PAIRS:
+        r = scan_value( tpt, s, buffer, length, 0 );
+        if( r < 0 )
+          return 0;
+        if( r == 0 && s->stack[ i ].count )
+        {
+          e.errnum = ERR_PROTOCOL;
+          e.type = fatal;
+          Throw( e );
+        }
+        if( r == 0 )
+          s->depth --;
+        else
+          s->stack[ i ].count ^= 1;
+        break;
+
+      case TRANSPORT_SCAN_BODY:
+        r = scan_value( tpt, s, buffer, length, 0 );
+        if( r < 0 )
+          return 0;
+        if( r == 0 )
+          s->depth --;
+        break;
+    }
+  }
+  return 1;
+}
+
+// switch transport direction, leaving write mode ends the message and flushes
+// the output buffer. starting to write drops leftovers of a message that was
+// abandoned halfway (i.e. by a lua error, which leaves the transport in write
+// mode), so they never reach the link.
+#ifdef LUARPC_ENABLE_IO_URING
+// send buffered output and wait for the first part of the reply with a single
+// call into the link layer. only done when nothing is left from earlier reads.
+static void transport_flush_read( Transport *tpt )
+{
+  int n;
+
+  if( ( tpt->wbuf_len == 0 && tpt->wq_len == 0 ) || transport_buffered( tpt ) > 0 )
+  {
+    transport_flush( tpt );
+    return;
+  }
+
+  transport_queue_segment( tpt );
+  tpt->rbuf_pos = tpt->rbuf_len = 0;
+  n = transport_write_read( tpt, tpt->wq, tpt->wq_len, tpt->rbuf, TRANSPORT_RBUF_SIZE );
+  transport_discard_output( tpt );
+  tpt->rbuf_len = n;
+}
+#endif
+
+void transport_set_mode( Transport *tpt, int mode )
+{
+  int previous = tpt->mode;
+
+  tpt->mode = mode;
+#ifdef LUARPC_ENABLE_IO_URING
+  // a switch from writing to reading means a reply is expected right away
+  if( previous == 1 && mode == 0 )
+    transport_flush_read( tpt );
+  else
+#endif
+  if( previous == 1 && mode != 1 )
+    transport_flush( tpt );
+  else if( mode == 1 )
+  {
+    // a gathered command has been read when it is answered
+    transport_gather_end( tpt );
+
+    // functions in a dropped message were counted as held by the peer, it
+    // is no longer known which are, so they all go in full again
+    if( tpt->wq_len != 0 || tpt->wbuf_len != 0 || tpt->capture )
+      tpt->funcs_sent_count = 0;
+    transport_discard_output( tpt );
+    tpt->capture = 0;
+  }
 }